@@ -0,0 +1,373 @@
+/*
+	Licensed to the Apache Software Foundation (ASF) under one
+	or more contributor license agreements.  See the NOTICE file
+	distributed with this work for additional information
+	regarding copyright ownership.  The ASF licenses this file
+	to you under the Apache License, Version 2.0 (the
+	"License"); you may not use this file except in compliance
+	with the License.  You may obtain a copy of the License at
+
+	http://www.apache.org/licenses/LICENSE-2.0
+
+	Unless required by applicable law or agreed to in writing,
+	software distributed under the License is distributed on an
+	"AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+	KIND, either express or implied.  See the License for the
+	specific language governing permissions and limitations
+	under the License.
+*/
+
+/* rpitrace.cc - pull the rpi-os scheduler trace and convert it to a Chrome trace */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <termios.h>
+#include <sys/select.h>
+
+#include <map>
+#include <string>
+#include <vector>
+
+
+
+//
+// Trace format, must match include/rpi-thread.h
+//
+#define THREAD_NAME_LEN				32
+
+#define THREAD_TRACE_MARKER			'\x06'
+#define THREAD_TRACE_MAGIC			0x43525452
+
+#define THREAD_TRACE_SWITCH_OUT		1
+#define THREAD_TRACE_SWITCH_IN		2
+#define THREAD_TRACE_WAKE			3
+
+struct thread_trace_t
+{
+	uint64_t	cycles;
+	uint32_t	thread_id;
+	uint32_t	object;
+	uint8_t		event;
+	uint8_t		state;
+	uint16_t	reserved;
+};
+
+struct thread_trace_header_t
+{
+	uint32_t	magic;
+	uint32_t	record_count;
+	uint32_t	name_count;
+	uint32_t	reserved;
+	uint64_t	start_cycles;
+	uint64_t	start_time;
+	uint64_t	dump_cycles;
+	uint64_t	dump_time;
+};
+
+struct thread_trace_name_t
+{
+	uint32_t	thread_id;
+	char		name[THREAD_NAME_LEN];
+};
+
+static_assert(sizeof(thread_trace_t) == 24, "trace record layout");
+static_assert(sizeof(thread_trace_header_t) == 48, "trace header layout");
+static_assert(sizeof(thread_trace_name_t) == 36, "trace name layout");
+
+
+
+//
+// Names of the thread states, indexed by THREAD_STATE_*
+//
+static const char* state_names[] =
+{
+	"Starting", "Scheduled", "Running", "TimedWait", "EventWait", "MutexWait", "Suspended", "Stopped", "SemWait", "CondWait", "RwlockWait", "MsgqWait", "MultiWait"
+};
+
+
+
+//
+// Seconds to wait for the trace after requesting it
+//
+#define TRACE_TIMEOUT				5
+
+
+
+//
+// Open the input. Anything but a tty is a captured serial log, which is only read,
+// so read-only files and pipes work. A tty is reopened for writing and configured.
+//
+static int open_input(const char* path, bool* is_tty)
+{
+	int fd = open(path, O_RDONLY | O_NOCTTY);
+	if (fd == -1) {
+		perror(path);
+		exit(EXIT_FAILURE);
+	}
+	*is_tty = isatty(fd);
+	if (!*is_tty)
+		return fd;
+
+	close(fd);
+	fd = open(path, O_RDWR | O_NOCTTY);
+	if (fd == -1) {
+		perror(path);
+		exit(EXIT_FAILURE);
+	}
+
+	// 8N1 at 115200 baud, no processing
+	struct termios termios;
+	if (tcgetattr(fd, &termios) == -1) {
+		perror("tcgetattr()");
+		exit(EXIT_FAILURE);
+	}
+	termios.c_cc[VTIME] = 0;
+	termios.c_cc[VMIN] = 0;
+	termios.c_iflag = 0;
+	termios.c_oflag = 0;
+	termios.c_cflag = CS8 | CREAD | CLOCAL;
+	termios.c_lflag = 0;
+	if (cfsetispeed(&termios, B115200) < 0 || cfsetospeed(&termios, B115200) < 0) {
+		perror("Failed to set baud-rate");
+		exit(EXIT_FAILURE);
+	}
+	if (tcsetattr(fd, TCSAFLUSH, &termios) == -1) {
+		perror("tcsetattr()");
+		exit(EXIT_FAILURE);
+	}
+	return fd;
+}
+
+
+
+//
+// Read a byte, with a timeout for devices. Returns false at the end of the input.
+//
+static bool read_byte(int fd, bool is_tty, uint8_t* byte)
+{
+	if (is_tty) {
+		fd_set rfds;
+		FD_ZERO(&rfds);
+		FD_SET(fd, &rfds);
+		struct timeval tv = { TRACE_TIMEOUT, 0 };
+		int res = select(fd + 1, &rfds, NULL, NULL, &tv);
+		if (res == -1) {
+			perror("select()");
+			exit(EXIT_FAILURE);
+		}
+		if (res == 0) {
+			fprintf(stderr, "Timeout while waiting for the trace\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	ssize_t len = read(fd, byte, 1);
+	if (len == -1) {
+		perror("read()");
+		exit(EXIT_FAILURE);
+	}
+	return len == 1;
+}
+
+
+
+//
+// Read a 32-bit little endian length
+//
+static bool read_length(int fd, bool is_tty, uint32_t* length)
+{
+	*length = 0;
+	for (int i = 0; i < 4; i++) {
+		uint8_t byte;
+		if (!read_byte(fd, is_tty, &byte))
+			return false;
+		*length |= (uint32_t)byte << (i * 8);
+	}
+	return true;
+}
+
+
+
+//
+// Read the trace data from the stream. Console output that precedes the trace,
+// framed or not, is skipped.
+//
+static std::vector<uint8_t> read_trace(int fd, bool is_tty)
+{
+	uint8_t byte;
+	uint32_t length;
+	while (read_byte(fd, is_tty, &byte)) {
+		// Skip framed strings
+		if (byte == '\x04') {
+			if (!read_length(fd, is_tty, &length))
+				break;
+			while (length-- && read_byte(fd, is_tty, &byte))
+				;
+			continue;
+		}
+		if (byte != THREAD_TRACE_MARKER)
+			continue;
+
+		// Read the trace
+		if (!read_length(fd, is_tty, &length))
+			break;
+		std::vector<uint8_t> data(length);
+		for (uint32_t i = 0; i < length; i++)
+			if (!read_byte(fd, is_tty, &data[i])) {
+				fprintf(stderr, "Trace is truncated\n");
+				exit(EXIT_FAILURE);
+			}
+		return data;
+	}
+
+	fprintf(stderr, "No trace found\n");
+	exit(EXIT_FAILURE);
+}
+
+
+
+//
+// Escape a string for JSON
+//
+static std::string json_string(const char* str)
+{
+	std::string result = "\"";
+	for (; *str; str++) {
+		if (*str == '"' || *str == '\\')
+			result += '\\';
+		if ((unsigned char)*str >= 0x20)
+			result += *str;
+	}
+	return result + "\"";
+}
+
+
+
+//
+// Convert the trace to Chrome trace event JSON, which Perfetto opens as well.
+// Every thread gets a track with a slice for each time it ran, and an
+// instant event for each time it was woken.
+//
+static void write_json(FILE* out, const std::vector<uint8_t>& data)
+{
+	// Check the data
+	const thread_trace_header_t* header = (const thread_trace_header_t*)data.data();
+	if (data.size() < sizeof(*header) || header->magic != THREAD_TRACE_MAGIC ||
+		data.size() < sizeof(*header) + header->record_count * sizeof(thread_trace_t) + header->name_count * sizeof(thread_trace_name_t)) {
+		fprintf(stderr, "Invalid trace data\n");
+		exit(EXIT_FAILURE);
+	}
+	const thread_trace_t* records = (const thread_trace_t*)(header + 1);
+	const thread_trace_name_t* names = (const thread_trace_name_t*)(records + header->record_count);
+
+	// Derive the clock frequency, fall back to the default ARM clock
+	double cycles_per_us = 700.0;
+	if (header->dump_time > header->start_time && header->dump_cycles > header->start_cycles)
+		cycles_per_us = (double)(header->dump_cycles - header->start_cycles) / (double)(header->dump_time - header->start_time);
+	uint64_t base = header->record_count ? records[0].cycles : header->dump_cycles;
+
+	fprintf(out, "{\"displayTimeUnit\":\"ns\",\"otherData\":{\"cycles_per_us\":%.3f},\"traceEvents\":[\n", cycles_per_us);
+	fprintf(out, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"args\":{\"name\":\"rpi-os\"}}");
+
+	// Thread names. Threads that exited have no name anymore.
+	std::map<uint32_t, std::string> thread_names;
+	for (uint32_t i = 0; i < header->name_count; i++) {
+		char name[THREAD_NAME_LEN + 1] = { 0 };
+		memcpy(name, names[i].name, THREAD_NAME_LEN);
+		thread_names[names[i].thread_id] = name;
+	}
+	for (uint32_t i = 0; i < header->record_count; i++)
+		if (thread_names.find(records[i].thread_id) == thread_names.end())
+			thread_names[records[i].thread_id] = "Thread " + std::to_string(records[i].thread_id);
+	for (auto& it : thread_names)
+		fprintf(out, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%u,\"args\":{\"name\":%s}}",
+			it.first, json_string(it.second.c_str()).c_str());
+
+	// Events
+	std::map<uint32_t, uint64_t> running;
+	for (uint32_t i = 0; i < header->record_count; i++) {
+		const thread_trace_t& record = records[i];
+		double ts = (double)(record.cycles - base) / cycles_per_us;
+		const char* state = record.state < sizeof(state_names) / sizeof(state_names[0]) ? state_names[record.state] : "Unknown";
+
+		switch (record.event) {
+		case THREAD_TRACE_SWITCH_IN:
+			running[record.thread_id] = record.cycles;
+			break;
+
+		case THREAD_TRACE_SWITCH_OUT: {
+			// The slice started before the oldest record if the switch in is missing
+			auto it = running.find(record.thread_id);
+			if (it == running.end())
+				break;
+			double start = (double)(it->second - base) / cycles_per_us;
+			running.erase(it);
+			fprintf(out, ",\n{\"name\":\"Running\",\"ph\":\"X\",\"pid\":1,\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"leaves\":\"%s\",\"object\":\"0x%08x\"}}",
+				record.thread_id, start, ts - start, state, record.object);
+			break;
+		}
+
+		case THREAD_TRACE_WAKE:
+			fprintf(out, ",\n{\"name\":\"%s\",\"ph\":\"i\",\"s\":\"t\",\"pid\":1,\"tid\":%u,\"ts\":%.3f,\"args\":{\"object\":\"0x%08x\"}}",
+				record.state ? "Wake" : "Timeout", record.thread_id, ts, record.object);
+			break;
+
+		default:
+			fprintf(stderr, "Skipping unknown event %u\n", record.event);
+			break;
+		}
+	}
+
+	// Threads that are still running at the time of the dump
+	double end = (double)(header->dump_cycles - base) / cycles_per_us;
+	for (auto& it : running) {
+		double start = (double)(it.second - base) / cycles_per_us;
+		fprintf(out, ",\n{\"name\":\"Running\",\"ph\":\"X\",\"pid\":1,\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f}", it.first, start, end - start);
+	}
+
+	fprintf(out, "\n]}\n");
+}
+
+
+
+int main(int argc, char* argv[])
+{
+	if (argc != 3) {
+		printf("USAGE: %s <dev|file> <output.json>\n", argv[0]);
+		printf("Example: %s /dev/ttyUSB0 trace.json\n", argv[0]);
+		printf("Requests the scheduler trace from a device, or reads it from a captured\n");
+		printf("serial log, and writes it as a Chrome trace for chrome://tracing or Perfetto.\n");
+		return EXIT_FAILURE;
+	}
+
+	// Open the input, request the trace from a device
+	bool is_tty;
+	int fd = open_input(argv[1], &is_tty);
+	if (is_tty) {
+		char marker = THREAD_TRACE_MARKER;
+		if (write(fd, &marker, 1) != 1) {
+			perror("write()");
+			return EXIT_FAILURE;
+		}
+	}
+
+	std::vector<uint8_t> data = read_trace(fd, is_tty);
+	close(fd);
+
+	// Write the trace
+	FILE* out = fopen(argv[2], "w");
+	if (out == NULL) {
+		perror(argv[2]);
+		return EXIT_FAILURE;
+	}
+	write_json(out, data);
+	fclose(out);
+
+	printf("Wrote %zu bytes of trace data to %s\n", data.size(), argv[2]);
+	return EXIT_SUCCESS;
+}
@@ -40,6 +40,44 @@ EXTERN_C void _disable_interrupts(void);
 
 
 
+//
+// Disable interrupts, returns the previous interrupt state
+//
+EXTERN_C uint32_t _save_and_disable_interrupts(void);
+
+
+
+//
+// Restore the interrupt state returned by _save_and_disable_interrupts
+//
+EXTERN_C void _restore_interrupts(uint32_t state);
+
+
+
+//
+// Take and release the kernel lock with interrupts disabled. Critical sections
+// take it implicitly on multi-core builds; these are for code that must let the
+// other cores run while it waits with interrupts disabled.
+//
+EXTERN_C void _kernel_lock(void);
+EXTERN_C void _kernel_unlock(void);
+
+
+
+//
+// Get the id of the core that runs the caller
+//
+EXTERN_C uint32_t _get_core_id(void);
+
+
+
+//
+// Wake cores that wait for an event
+//
+EXTERN_C void _send_event(void);
+
+
+
 //
 // Get current interrupts
 //
@@ -93,3 +131,34 @@ EXTERN_C void* _get_stack_pointer(void);
 // Switch from one thread to another
 //
 EXTERN_C uint32_t _switch_to_thread(uint32_t* cur_regs, uint32_t* new_regs);
+
+
+
+//
+// Start and read the 32-bit cycle counter
+//
+EXTERN_C void _enable_cycle_counter(void);
+EXTERN_C uint32_t _get_cycle_count(void);
+
+
+
+//
+// Get and set the VFP exception register
+//
+EXTERN_C uint32_t _get_fpexc(void);
+EXTERN_C void _set_fpexc(uint32_t fpexc);
+
+
+
+//
+// Save and load the VFP registers d0-d15 and fpscr
+//
+EXTERN_C void _vfp_save(uint32_t* state);
+EXTERN_C void _vfp_load(uint32_t* state);
+
+
+
+//
+// Enable the MMU with a flat translation table, and the caches
+//
+EXTERN_C void _mmu_enable(uint32_t* table);
@@ -19,12 +19,22 @@
 #pragma once
 
 #include "rpi-base.h"
+#include "rpi-interrupts.h"
 
 
 //
 // Enable the ARM timer
 //
-EXTERN_C void arm_timer_enable(uint32_t interval);
+// The timer fires every interval microseconds and invokes handler from the IRQ handler.
+//
+EXTERN_C void arm_timer_enable(uint32_t interval, irq_handler_t handler);
+
+
+
+//
+// Restart the current interval from the beginning
+//
+EXTERN_C void arm_timer_restart(void);
 
 
 
@@ -0,0 +1,85 @@
+/*
+	Licensed to the Apache Software Foundation (ASF) under one
+	or more contributor license agreements.  See the NOTICE file
+	distributed with this work for additional information
+	regarding copyright ownership.  The ASF licenses this file
+	to you under the Apache License, Version 2.0 (the
+	"License"); you may not use this file except in compliance
+	with the License.  You may obtain a copy of the License at
+
+	http://www.apache.org/licenses/LICENSE-2.0
+
+	Unless required by applicable law or agreed to in writing,
+	software distributed under the License is distributed on an
+	"AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+	KIND, either express or implied.  See the License for the
+	specific language governing permissions and limitations
+	under the License.
+*/
+#pragma once
+
+#include "rpi-base.h"
+#include "rpi-mutex.h"
+#include "rpi-systimer.h"
+
+
+
+//
+// Maximum condition variable name length
+//
+#define COND_NAME_LEN	32
+
+
+
+//
+// Condition variable type
+//
+typedef struct cond_t cond_t;
+
+
+
+//
+// Create a condition variable
+//
+EXTERN_C cond_t* cond_create(const char* name);
+
+
+
+//
+// Destroy a condition variable
+//
+EXTERN_C void cond_destroy(cond_t* cond);
+
+
+
+//
+// Get condition variable name
+//
+EXTERN_C const char* cond_get_name(cond_t* cond);
+
+
+
+//
+// Release a mutex that the current thread holds and wait for the condition to be
+// signaled, then reacquire the mutex. The release and the start of the wait are
+// atomic. Returns 0 when the timeout elapsed before the condition was signaled; 
+// the mutex is held again either way. All threads that wait on a condition at the
+// same time must use the same mutex.
+//
+EXTERN_C uint32_t cond_wait(cond_t* cond, mutex_t* mutex, sys_time_t timeout);
+
+
+
+//
+// Wake the thread that has waited longest for the condition. It is moved to the 
+// wait queue of the mutex, and runs once it holds the mutex.
+//
+EXTERN_C void cond_signal(cond_t* cond);
+
+
+
+//
+// Wake all threads that wait for the condition. They are moved to the wait queue
+// of the mutex in one step, and acquire the mutex in turn.
+//
+EXTERN_C void cond_broadcast(cond_t* cond);
@@ -20,6 +20,7 @@
 
 #include "rpi-base.h"
 #include "rpi-systimer.h"
+#include "rpi-wait.h"
 
 
 
@@ -70,7 +71,9 @@ EXTERN_C const char* event_get_name(event_t* event);
 
 
 //
-// Signal an event
+// Signal an event. An auto event releases the longest waiting thread or task, or 
+// else stays signaled for the next wait. A manual event releases all waiting 
+// threads and tasks at once, and stays signaled until event_reset.
 //
 EXTERN_C void event_signal(event_t* event);
 
@@ -95,3 +98,26 @@ EXTERN_C uint32_t event_is_signaled(event_t* event);
 //
 //
 EXTERN_C uint32_t event_wait(event_t* event, sys_time_t timeout);
+
+
+
+//
+// Task type, see rpi-task.h
+//
+struct task_t;
+
+
+
+//
+// Wait for an event from a task. Returns 1 when the wait completed immediately,
+// 0 when the task was queued and will be resumed with the wait result.
+//
+EXTERN_C uint32_t event_wait_task(event_t* event, struct task_t* task, sys_time_t timeout);
+
+
+
+//
+// Wait for the event among other objects with thread_wait_multiple. An auto event is reset when it is acquired, a manual event stays signaled.
+//
+EXTERN_C const thread_wait_ops_t event_wait_ops;
+#define EVENT_WAIT_OBJECT(event)		{ &event_wait_ops, (event) }
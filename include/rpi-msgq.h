@@ -0,0 +1,108 @@
+/*
+	Licensed to the Apache Software Foundation (ASF) under one
+	or more contributor license agreements.  See the NOTICE file
+	distributed with this work for additional information
+	regarding copyright ownership.  The ASF licenses this file
+	to you under the Apache License, Version 2.0 (the
+	"License"); you may not use this file except in compliance
+	with the License.  You may obtain a copy of the License at
+
+	http://www.apache.org/licenses/LICENSE-2.0
+
+	Unless required by applicable law or agreed to in writing,
+	software distributed under the License is distributed on an
+	"AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+	KIND, either express or implied.  See the License for the
+	specific language governing permissions and limitations
+	under the License.
+*/
+#pragma once
+
+#include "rpi-base.h"
+#include "rpi-systimer.h"
+#include "rpi-wait.h"
+
+
+
+//
+// Maximum message queue name length
+//
+#define MSGQ_NAME_LEN	32
+
+
+
+//
+// Message queue type
+//
+// A message is a pointer. The queue only stores the pointer, so a buffer that is
+// sent is handed over to the receiver without being copied: the sender gives up
+// the buffer, and the receiver owns it from then on. Small messages of up to 32
+// bits can be sent inline by casting them to a pointer.
+//
+typedef struct msgq_t msgq_t;
+
+
+
+//
+// Create a message queue that holds up to capacity messages
+//
+EXTERN_C msgq_t* msgq_create(const char* name, uint32_t capacity);
+
+
+
+//
+// Destroy a message queue. Messages that are still queued are discarded.
+//
+EXTERN_C void msgq_destroy(msgq_t* msgq);
+
+
+
+//
+// Get message queue name
+//
+EXTERN_C const char* msgq_get_name(msgq_t* msgq);
+
+
+
+//
+// Send a message, waiting up to timeout microseconds while the queue is full. 
+// Returns 0 on timeout, in which case the sender still owns the message. With
+// TIMEOUT_IMMEDIATE, can be called from interrupt handlers.
+//
+EXTERN_C uint32_t msgq_send(msgq_t* msgq, void* msg, sys_time_t timeout);
+
+
+
+//
+// Receive the oldest message, waiting up to timeout microseconds while the queue
+// is empty. Returns 0 on timeout.
+//
+EXTERN_C uint32_t msgq_receive(msgq_t* msgq, void** msg, sys_time_t timeout);
+
+
+
+//
+// Receive up to max_count messages in order, waiting up to timeout microseconds 
+// while the queue is empty. All messages that are queued when the thread runs are
+// drained at once, so a busy receiver handles many messages per wakeup. Returns
+// the number of messages received, 0 on timeout.
+//
+EXTERN_C uint32_t msgq_receive_batch(msgq_t* msgq, void** msgs, uint32_t max_count, sys_time_t timeout);
+
+
+
+//
+// Get the number of queued messages
+//
+EXTERN_C uint32_t msgq_get_count(msgq_t* msgq);
+
+
+
+//
+// Wait for the message queue among other objects with thread_wait_multiple. The 
+// queue is ready while it holds messages. It is only tested, no message is taken:
+// the thread receives them with a zero timeout afterwards. Other threads may have
+// received them by then, and the queue can't be used with wait_all.
+//
+EXTERN_C const thread_wait_ops_t msgq_wait_ops;
+#define MSGQ_WAIT_OBJECT(msgq)		{ &msgq_wait_ops, (msgq) }
@@ -20,6 +20,7 @@
 
 #include "rpi-base.h"
 #include "rpi-systimer.h"
+#include "rpi-wait.h"
 
 
 
@@ -69,3 +70,52 @@ EXTERN_C uint32_t mutex_lock(mutex_t* mutex, sys_time_t timeout);
 // Unlock a mutex
 //
 EXTERN_C void mutex_unlock(mutex_t* mutex);
+
+
+
+//
+// Release a mutex that the current thread holds, returns its recursive lock count. 
+// Used by condition variables, see rpi-cond.h.
+//
+EXTERN_C uint32_t mutex_release(mutex_t* mutex);
+
+
+
+//
+// Reacquire a mutex released by mutex_release, restoring its recursive lock count
+//
+EXTERN_C void mutex_reacquire(mutex_t* mutex, uint32_t count);
+
+
+
+//
+// Move up to count threads from a wait queue to the wait queue of a mutex, without
+// waking them. A thread that is moved is woken as the owner of the mutex, as if it
+// had called mutex_lock. Returns the number of threads that were moved.
+//
+struct thread_queue_t;
+EXTERN_C uint32_t mutex_requeue(mutex_t* mutex, struct thread_queue_t* queue, uint32_t count);
+
+
+
+//
+// Task type, see rpi-task.h
+//
+struct task_t;
+
+
+
+//
+// Lock a mutex from a task. Returns 1 when the lock completed immediately, 0 when
+// the task was queued and will be resumed with the lock result. Tasks unlock the
+// mutex with mutex_unlock.
+//
+EXTERN_C uint32_t mutex_lock_task(mutex_t* mutex, struct task_t* task, sys_time_t timeout);
+
+
+
+//
+// Wait for the mutex among other objects with thread_wait_multiple. The mutex is locked by the waiting thread when it is acquired.
+//
+EXTERN_C const thread_wait_ops_t mutex_wait_ops;
+#define MUTEX_WAIT_OBJECT(mutex)		{ &mutex_wait_ops, (mutex) }
@@ -0,0 +1,95 @@
+/*
+	Licensed to the Apache Software Foundation (ASF) under one
+	or more contributor license agreements.  See the NOTICE file
+	distributed with this work for additional information
+	regarding copyright ownership.  The ASF licenses this file
+	to you under the Apache License, Version 2.0 (the
+	"License"); you may not use this file except in compliance
+	with the License.  You may obtain a copy of the License at
+
+	http://www.apache.org/licenses/LICENSE-2.0
+
+	Unless required by applicable law or agreed to in writing,
+	software distributed under the License is distributed on an
+	"AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+	KIND, either express or implied.  See the License for the
+	specific language governing permissions and limitations
+	under the License.
+*/
+#pragma once
+
+#include "rpi-base.h"
+#include "rpi-systimer.h"
+
+
+
+//
+// Maximum reader-writer lock name length
+//
+#define RWLOCK_NAME_LEN				32
+
+
+
+//
+// Reader-writer lock flags
+//
+#define RWLOCK_WRITER_PREFERENCE	0x01	// Readers queue behind waiting writers
+
+
+
+//
+// Reader-writer lock type
+//
+typedef struct rwlock_t rwlock_t;
+
+
+
+//
+// Create a reader-writer lock. Without writer preference, readers share the lock
+// whenever no writer holds it, so a steady stream of readers can starve writers.
+// With writer preference, new readers wait while a writer waits.
+//
+EXTERN_C rwlock_t* rwlock_create(const char* name, uint32_t flags);
+
+
+
+//
+// Destroy a reader-writer lock
+//
+EXTERN_C void rwlock_destroy(rwlock_t* rwlock);
+
+
+
+//
+// Get reader-writer lock name
+//
+EXTERN_C const char* rwlock_get_name(rwlock_t* rwlock);
+
+
+
+//
+// Acquire a reader-writer lock shared, returns 0 on timeout
+//
+EXTERN_C uint32_t rwlock_read_lock(rwlock_t* rwlock, sys_time_t timeout);
+
+
+
+//
+// Release a shared acquisition of a reader-writer lock
+//
+EXTERN_C void rwlock_read_unlock(rwlock_t* rwlock);
+
+
+
+//
+// Acquire a reader-writer lock exclusively, returns 0 on timeout. The lock is not
+// recursive.
+//
+EXTERN_C uint32_t rwlock_write_lock(rwlock_t* rwlock, sys_time_t timeout);
+
+
+
+//
+// Release an exclusive acquisition of a reader-writer lock
+//
+EXTERN_C void rwlock_write_unlock(rwlock_t* rwlock);
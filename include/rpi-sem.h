@@ -0,0 +1,99 @@
+/*
+	Licensed to the Apache Software Foundation (ASF) under one
+	or more contributor license agreements.  See the NOTICE file
+	distributed with this work for additional information
+	regarding copyright ownership.  The ASF licenses this file
+	to you under the Apache License, Version 2.0 (the
+	"License"); you may not use this file except in compliance
+	with the License.  You may obtain a copy of the License at
+
+	http://www.apache.org/licenses/LICENSE-2.0
+
+	Unless required by applicable law or agreed to in writing,
+	software distributed under the License is distributed on an
+	"AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+	KIND, either express or implied.  See the License for the
+	specific language governing permissions and limitations
+	under the License.
+*/
+#pragma once
+
+#include "rpi-base.h"
+#include "rpi-systimer.h"
+#include "rpi-wait.h"
+
+
+
+//
+// Maximum semaphore name length
+//
+#define SEM_NAME_LEN	32
+
+
+
+//
+// Semaphore type
+//
+typedef struct sem_t sem_t;
+
+
+
+//
+// Create a counting semaphore with an initial count, which can't be posted beyond
+// the maximum count
+//
+EXTERN_C sem_t* sem_create(const char* name, uint32_t initial_count, uint32_t maximum_count);
+
+
+
+//
+// Destroy a semaphore
+//
+EXTERN_C void sem_destroy(sem_t* sem);
+
+
+
+//
+// Get semaphore name
+//
+EXTERN_C const char* sem_get_name(sem_t* sem);
+
+
+
+//
+// Post a semaphore, releasing the longest waiting thread or else incrementing the
+// count. Returns 0 when the count is at its maximum. Can be called from interrupt
+// handlers.
+//
+EXTERN_C uint32_t sem_post(sem_t* sem);
+
+
+
+//
+// Wait until the count of a semaphore can be decremented. Returns 0 on timeout.
+//
+EXTERN_C uint32_t sem_wait(sem_t* sem, sys_time_t timeout);
+
+
+
+//
+// Decrement the count of a semaphore if it is not zero, returns whether it was 
+// decremented. Never blocks or enters the scheduler, so it can be called from
+// interrupt handlers.
+//
+EXTERN_C uint32_t sem_trywait(sem_t* sem);
+
+
+
+//
+// Get the current count of a semaphore
+//
+EXTERN_C uint32_t sem_get_count(sem_t* sem);
+
+
+
+//
+// Wait for the semaphore among other objects with thread_wait_multiple. The count is decremented when the semaphore is acquired.
+//
+EXTERN_C const thread_wait_ops_t sem_wait_ops;
+#define SEM_WAIT_OBJECT(sem)		{ &sem_wait_ops, (sem) }
@@ -0,0 +1,66 @@
+/*
+	Licensed to the Apache Software Foundation (ASF) under one
+	or more contributor license agreements.  See the NOTICE file
+	distributed with this work for additional information
+	regarding copyright ownership.  The ASF licenses this file
+	to you under the Apache License, Version 2.0 (the
+	"License"); you may not use this file except in compliance
+	with the License.  You may obtain a copy of the License at
+
+	http://www.apache.org/licenses/LICENSE-2.0
+
+	Unless required by applicable law or agreed to in writing,
+	software distributed under the License is distributed on an
+	"AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+	KIND, either express or implied.  See the License for the
+	specific language governing permissions and limitations
+	under the License.
+*/
+#pragma once
+
+#include "rpi-base.h"
+
+
+
+//
+// Multi-core support for the BCM2836. Every core runs its own scheduler thread;
+// the cores share the threads and the scheduler data, which is protected by the 
+// kernel lock that critical sections take (see asm-functions.s). Single-core 
+// builds don't use these functions.
+//
+#if defined( RPI2 )
+
+
+
+//
+// Enable the MMU and caches on the boot core, must be called before any other
+// function that takes the kernel lock
+//
+EXTERN_C void smp_init(void);
+
+
+
+//
+// Start the secondary cores. Each core enters the scheduler and runs threads
+// once it is up.
+//
+EXTERN_C void smp_start_cores(void);
+
+
+
+//
+// Send an inter-processor interrupt to a core, which makes it reschedule
+//
+EXTERN_C void smp_send_ipi(uint32_t core);
+
+
+
+//
+// Acknowledge the inter-processor interrupt of the current core, called from the
+// IRQ handler
+//
+EXTERN_C void smp_interrupt(void);
+
+
+
+#endif
@@ -0,0 +1,217 @@
+/*
+	Licensed to the Apache Software Foundation (ASF) under one
+	or more contributor license agreements.  See the NOTICE file
+	distributed with this work for additional information
+	regarding copyright ownership.  The ASF licenses this file
+	to you under the Apache License, Version 2.0 (the
+	"License"); you may not use this file except in compliance
+	with the License.  You may obtain a copy of the License at
+
+	http://www.apache.org/licenses/LICENSE-2.0
+
+	Unless required by applicable law or agreed to in writing,
+	software distributed under the License is distributed on an
+	"AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+	KIND, either express or implied.  See the License for the
+	specific language governing permissions and limitations
+	under the License.
+*/
+#pragma once
+
+#include "rpi-base.h"
+#include "asm-functions.h"
+
+#include <string.h>
+
+
+
+//
+// Single-producer/single-consumer ring
+//
+// A lock-free ring of fixed-size elements for one producer and one consumer, for
+// instance an interrupt handler and a thread. Neither side disables interrupts or
+// takes a lock: the producer only writes the head and the consumer only writes 
+// the tail, and memory barriers order the element copies against the index that
+// publishes or frees them.
+//
+// The head and tail count the elements pushed and popped, and wrap naturally; the
+// capacity must be a power of two so they can be masked into an index.
+//
+// The C functions work on any element size. C++ code can use spsc_ring<T, Capacity>
+// below, which holds its own storage and copies elements of type T.
+//
+typedef struct spsc_t
+{
+	uint8_t*			buffer;			// Element storage
+	uint32_t			size;			// Element size in bytes
+	uint32_t			mask;			// Capacity - 1
+	volatile uint32_t	head;			// Number of elements pushed, written by the producer
+	volatile uint32_t	tail;			// Number of elements popped, written by the consumer
+} spsc_t;
+
+
+
+//
+// Initialize a ring on a buffer of capacity elements of size bytes
+//
+static inline void spsc_init(spsc_t* ring, void* buffer, uint32_t size, uint32_t capacity)
+{
+	ASSERT(capacity != 0 && (capacity & (capacity - 1)) == 0);
+
+	ring->buffer = (uint8_t*)buffer;
+	ring->size = size;
+	ring->mask = capacity - 1;
+	ring->head = 0;
+	ring->tail = 0;
+}
+
+
+
+//
+// Get the number of elements in the ring
+//
+static inline uint32_t spsc_count(const spsc_t* ring)
+{
+	return ring->head - ring->tail;
+}
+
+
+
+//
+// Push up to count elements, returns the number of elements pushed. Producer only.
+//
+static inline uint32_t spsc_push_bulk(spsc_t* ring, const void* items, uint32_t count)
+{
+	uint32_t head = ring->head;
+	uint32_t space = ring->mask + 1 - (head - ring->tail);
+	if (count > space)
+		count = space;
+	if (count == 0)
+		return 0;
+
+	// Read the tail before writing the slots that it freed
+	_dmb();
+
+	// Copy up to the end of the buffer, and the rest to the start
+	uint32_t index = head & ring->mask;
+	uint32_t first = ring->mask + 1 - index;
+	if (first > count)
+		first = count;
+	memcpy(ring->buffer + index * ring->size, items, first * ring->size);
+	memcpy(ring->buffer, (const uint8_t*)items + first * ring->size, (count - first) * ring->size);
+
+	// Make the elements visible before the head that publishes them
+	_dmb();
+	ring->head = head + count;
+
+	return count;
+}
+
+
+
+//
+// Pop up to count elements, returns the number of elements popped. Consumer only.
+//
+static inline uint32_t spsc_pop_bulk(spsc_t* ring, void* items, uint32_t count)
+{
+	uint32_t tail = ring->tail;
+	uint32_t available = ring->head - tail;
+	if (count > available)
+		count = available;
+	if (count == 0)
+		return 0;
+
+	// Read the head before reading the elements that it published
+	_dmb();
+
+	// Copy up to the end of the buffer, and the rest from the start
+	uint32_t index = tail & ring->mask;
+	uint32_t first = ring->mask + 1 - index;
+	if (first > count)
+		first = count;
+	memcpy(items, ring->buffer + index * ring->size, first * ring->size);
+	memcpy((uint8_t*)items + first * ring->size, ring->buffer, (count - first) * ring->size);
+
+	// Finish reading the elements before the tail frees their slots
+	_dmb();
+	ring->tail = tail + count;
+
+	return count;
+}
+
+
+
+//
+// Push and pop a single element, return whether the ring had room or an element
+//
+static inline uint32_t spsc_push(spsc_t* ring, const void* item)
+{
+	return spsc_push_bulk(ring, item, 1);
+}
+
+static inline uint32_t spsc_pop(spsc_t* ring, void* item)
+{
+	return spsc_pop_bulk(ring, item, 1);
+}
+
+
+
+#ifdef __cplusplus
+
+#include <type_traits>
+
+//
+// Typed ring with static storage. Elements are copied with memcpy, so T must be
+// trivially copyable.
+//
+template <typename T, uint32_t Capacity>
+class spsc_ring
+{
+	static_assert(Capacity != 0 && (Capacity & (Capacity - 1)) == 0, "The capacity must be a power of two");
+	static_assert(std::is_trivially_copyable<T>::value, "The element type must be trivially copyable");
+
+public:
+
+	spsc_ring()
+	{
+		spsc_init(&ring_, items_, sizeof(T), Capacity);
+	}
+
+	bool push(const T& item)
+	{
+		return spsc_push_bulk(&ring_, &item, 1) != 0;
+	}
+
+	bool pop(T& item)
+	{
+		return spsc_pop_bulk(&ring_, &item, 1) != 0;
+	}
+
+	uint32_t push(const T* items, uint32_t count)
+	{
+		return spsc_push_bulk(&ring_, items, count);
+	}
+
+	uint32_t pop(T* items, uint32_t count)
+	{
+		return spsc_pop_bulk(&ring_, items, count);
+	}
+
+	uint32_t count() const
+	{
+		return spsc_count(&ring_);
+	}
+
+	// The ring as seen by the C functions, to share it with C code
+	spsc_t* ring()
+	{
+		return &ring_;
+	}
+
+private:
+
+	spsc_t	ring_;
+	T		items_[Capacity];
+};
+
+#endif
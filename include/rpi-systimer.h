@@ -67,6 +67,15 @@ EXTERN_C void sys_timer_enable();
 
 
 
+//
+// Set the earliest deadline of the thread scheduler. The system timer interrupt
+// occurs at the deadline or at the deadline of an installed timer, whichever is
+// earlier. Pass TIMEOUT_INFINITE when no thread is waiting with a timeout.
+//
+EXTERN_C void sys_timer_set_deadline(sys_time_t deadline);
+
+
+
 //
 // System timer callback
 //
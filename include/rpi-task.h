@@ -0,0 +1,211 @@
+/*
+	Licensed to the Apache Software Foundation (ASF) under one
+	or more contributor license agreements.  See the NOTICE file
+	distributed with this work for additional information
+	regarding copyright ownership.  The ASF licenses this file
+	to you under the Apache License, Version 2.0 (the
+	"License"); you may not use this file except in compliance
+	with the License.  You may obtain a copy of the License at
+
+	http://www.apache.org/licenses/LICENSE-2.0
+
+	Unless required by applicable law or agreed to in writing,
+	software distributed under the License is distributed on an
+	"AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+	KIND, either express or implied.  See the License for the
+	specific language governing permissions and limitations
+	under the License.
+*/
+#pragma once
+
+#include "rpi-base.h"
+#include "rpi-event.h"
+#include "rpi-mutex.h"
+#include "rpi-systimer.h"
+#include "rpi-thread.h"
+#include "rpi-uart.h"
+
+
+
+//
+// Stackless tasks
+//
+// A task is a function that runs on a task runner thread and that can wait for
+// events, mutexes, time and UART I/O without blocking the thread. Many tasks share
+// one runner thread and its stack; a task itself only takes a task_t.
+//
+// The task function is re-entered from the top every time the task resumes, and
+// continues at the last wait point through the TASK_BEGIN switch. Local variables
+// are not preserved across waits, so keep state in a structure that embeds the
+// task_t and retrieve it through task->arg. Waits can't be used in a switch
+// statement of the task function itself.
+//
+//	static uint32_t echo_task(task_t* task)
+//	{
+//		echo_t* echo = (echo_t*)task->arg;
+//		TASK_BEGIN(task);
+//		while (1)
+//		{
+//			TASK_UART_GETC(task, &echo->ch);
+//			TASK_UART_PUTC(task, echo->ch);
+//		}
+//		TASK_END(task);
+//	}
+//
+
+
+
+//
+// Task types
+//
+typedef struct task_t task_t;
+typedef struct task_runner_t task_runner_t;
+
+
+
+//
+// Task function, returns TASK_WAITING when the task waits and TASK_DONE when it completed
+//
+typedef uint32_t(*task_fun_t)(task_t* task);
+
+#define TASK_WAITING				0
+#define TASK_DONE					1
+
+
+
+//
+// Task states
+//
+#define TASK_STATE_READY			0
+#define TASK_STATE_RUNNING			1
+#define TASK_STATE_WAITING			2
+#define TASK_STATE_DONE				3
+
+
+
+//
+// Queue of tasks, used for ready tasks and for the tasks that wait on an object
+//
+typedef struct task_queue_t
+{
+	task_t*		head;
+	task_t*		tail;
+} task_queue_t;
+
+
+
+//
+// Task structure. The fields are private to the task runtime, except for arg.
+//
+struct task_t
+{
+	task_fun_t		fun;			// Task function
+	void*			arg;			// Task argument
+	task_runner_t*	runner;			// Runner that the task runs on
+	task_t*			next;			// Ready or wait queue links
+	task_t*			prev;
+	task_queue_t*	wait_queue;		// Queue of the object that the task waits on
+	task_t*			sleep_next;		// Timeout list links
+	task_t*			sleep_prev;
+	sys_time_t		deadline;		// Timeout, TIMEOUT_INFINITE if none
+	uint16_t		resume;			// Resume point in the task function
+	uint8_t			state;			// TASK_STATE_*
+	uint8_t			result;			// Result of the last wait
+};
+
+
+
+//
+// Task function structure
+//
+#define TASK_BEGIN(task)			switch ((task)->resume) { case 0:
+#define TASK_END(task)				} (task)->resume = 0; return TASK_DONE
+#define TASK_EXIT(task)				do { (task)->resume = 0; return TASK_DONE; } while (0)
+
+
+
+//
+// Wait for an operation that returns 1 if it completed immediately, or 0 when it
+// queued the task to be resumed later
+//
+#define TASK_AWAIT(task, op)		do { (task)->resume = __LINE__; if (!(op)) return TASK_WAITING; case __LINE__:; } while (0)
+
+
+
+//
+// Waits. The result of the last wait is available as TASK_RESULT: 1 if the wait
+// succeeded, 0 if it timed out.
+//
+#define TASK_RESULT(task)						((task)->result)
+#define TASK_YIELD(task)						TASK_AWAIT(task, task_yield(task))
+#define TASK_SLEEP(task, microseconds)			TASK_AWAIT(task, task_sleep(task, microseconds))
+#define TASK_WAIT_EVENT(task, event, timeout)	TASK_AWAIT(task, event_wait_task(event, task, timeout))
+#define TASK_LOCK_MUTEX(task, mutex, timeout)	TASK_AWAIT(task, mutex_lock_task(mutex, task, timeout))
+
+
+
+//
+// UART I/O, retried when the UART interrupts report a received byte or TX space
+//
+#define TASK_UART_GETC(task, byte)	do { (task)->resume = __LINE__; case __LINE__: if (!uart_trygetc(byte)) return uart_wait_rx_task(task); } while (0)
+#define TASK_UART_PUTC(task, byte)	do { (task)->resume = __LINE__; case __LINE__: if (!uart_tryputc(byte)) return uart_wait_tx_task(task); } while (0)
+
+
+
+//
+// Create a task runner thread
+//
+EXTERN_C task_runner_t* task_runner_create(uint32_t stack_size, char const* name, uint32_t priority);
+
+
+
+//
+// Start a task on a runner. The task structure is owned by the caller and must
+// stay valid until the task is done. Can be called from any thread or interrupt.
+//
+EXTERN_C void task_start(task_runner_t* runner, task_t* task, task_fun_t fun, void* arg);
+
+
+
+//
+// Check whether a task is done
+//
+EXTERN_C uint32_t task_is_done(task_t* task);
+
+
+
+//
+// Wait primitives used by the macros above
+//
+EXTERN_C uint32_t task_yield(task_t* task);
+EXTERN_C uint32_t task_sleep(task_t* task, uint32_t microseconds);
+
+
+
+//
+// Queue a task on the wait queue of an object, with a timeout. Must be called with
+// interrupts disabled; the task is resumed by task_queue_wake_one/all or when the
+// timeout elapses.
+//
+EXTERN_C void task_queue_wait(task_queue_t* queue, task_t* task, sys_time_t timeout);
+
+
+
+//
+// Resume the task at the head of a wait queue with a result, returns the task or NULL
+//
+EXTERN_C task_t* task_queue_wake_one(task_queue_t* queue, uint32_t result);
+
+
+
+//
+// Resume all tasks on a wait queue with a result, returns the number of tasks resumed
+//
+EXTERN_C uint32_t task_queue_wake_all(task_queue_t* queue, uint32_t result);
+
+
+
+//
+// Get the id of the runner thread of a task
+//
+EXTERN_C thread_id_t task_get_thread_id(task_t* task);
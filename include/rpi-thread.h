@@ -22,6 +22,7 @@
 #include "rpi-event.h"
 #include "rpi-mutex.h"
 #include "rpi-systimer.h"
+#include "rpi-wait.h"
 
 
 
@@ -34,6 +35,16 @@
 
 
 
+//
+// Stacks are recycled in pools of power-of-two size classes from the minimum to the
+// maximum pooled size. Requested sizes are rounded up to their class, larger stacks
+// are allocated from the heap.
+//
+#define THREAD_STACK_MIN_SIZE		0x400
+#define THREAD_STACK_MAX_SIZE		0x10000
+
+
+
 //
 // Maximum thread name length
 //
@@ -41,6 +52,38 @@
 
 
 
+//
+// Number of thread priority levels. Ready threads of a higher priority always
+// run before ready threads of a lower priority, threads of equal priority run
+// round-robin.
+//
+#define THREAD_PRIORITY_COUNT		32
+
+
+
+//
+// Thread priorities
+//
+#define THREAD_PRIORITY_LOWEST		0
+#define THREAD_PRIORITY_DEFAULT		16
+#define THREAD_PRIORITY_HIGHEST		(THREAD_PRIORITY_COUNT - 1)
+
+
+
+//
+// Number of thread-local storage keys
+//
+#define THREAD_TLS_KEY_COUNT		16
+
+
+
+//
+// Thread affinity mask, bit N allows the thread to run on core N
+//
+#define THREAD_AFFINITY_ALL			((1u << RPI_CORE_COUNT) - 1)
+
+
+
 //
 // Thread id
 //
@@ -62,6 +105,149 @@ typedef uint32_t thread_id_t;
 
 
 
+//
+// Thread states
+//
+#define THREAD_STATE_STARTING		0
+#define THREAD_STATE_SCHEDULED		1
+#define THREAD_STATE_RUNNING		2
+#define THREAD_STATE_TIMED_WAIT		3
+#define THREAD_STATE_EVENT_WAIT		4
+#define THREAD_STATE_MUTEX_WAIT		5
+#define THREAD_STATE_SUSPENDED		6
+#define THREAD_STATE_STOPPED		7
+#define THREAD_STATE_SEM_WAIT		8
+#define THREAD_STATE_COND_WAIT		9
+#define THREAD_STATE_RWLOCK_WAIT	10
+#define THREAD_STATE_MSGQ_WAIT		11
+#define THREAD_STATE_MULTI_WAIT		12
+#define THREAD_STATE_COUNT			13
+
+
+
+//
+// Thread-local storage key, and the destructor that is run for the value of a key 
+// when a thread exits
+//
+typedef uint32_t thread_tls_key_t;
+typedef void (*thread_tls_destructor_t)(void* value);
+
+
+
+//
+// Thread statistics. Time is measured in CPU cycles.
+//
+typedef struct thread_stats_t
+{
+	uint64_t	state_cycles[THREAD_STATE_COUNT];	// Cycles spent in each state, running and ready included
+	uint32_t	switch_count;						// Number of times the thread was switched in
+	uint32_t	yield_count;						// Voluntary switches: yield, sleep, wait, suspend
+	uint32_t	preempt_count;						// Forced switches by preemption
+} thread_stats_t;
+
+
+
+//
+// Statistics of a periodic thread. Times are in microseconds, jitter is the delay 
+// from the release of a job until the thread runs, response time the delay from
+// the release until the job completes.
+//
+typedef struct thread_period_stats_t
+{
+	uint32_t	period;				// Period and relative deadline
+	uint32_t	deadline;
+	uint32_t	release_count;		// Number of jobs released
+	uint32_t	miss_count;			// Number of jobs that completed after their deadline
+	uint32_t	skip_count;			// Number of releases skipped because a job overran its period
+	uint32_t	jitter_last;		// Release jitter of the last job
+	uint32_t	jitter_max;			// Largest release jitter
+	uint64_t	jitter_total;		// Sum of the release jitter of all jobs
+	uint32_t	response_last;		// Response time of the last completed job
+	uint32_t	response_max;		// Worst-case response time
+} thread_period_stats_t;
+
+
+
+//
+// Scheduler trace. The scheduler logs every switch and wake in a ring of the last
+// THREAD_TRACE_COUNT events, which can be sent to the host with thread_trace_dump.
+//
+// Note: this must always be a power of two.
+//
+#define THREAD_TRACE_COUNT			1024
+
+
+
+//
+// Trace events
+//
+#define THREAD_TRACE_SWITCH_OUT		1		// State is the state left in, object the wait object
+#define THREAD_TRACE_SWITCH_IN		2		// Object is the id of the thread switched from
+#define THREAD_TRACE_WAKE			3		// State is the wait result, object the wait object
+
+
+
+//
+// Trace record
+//
+typedef struct thread_trace_t
+{
+	uint64_t	cycles;			// Cycle count at the event
+	uint32_t	thread_id;		// Thread the event applies to
+	uint32_t	object;			// Event specific, see above
+	uint8_t		event;			// THREAD_TRACE_*
+	uint8_t		state;			// Event specific, see above
+	uint16_t	reserved;
+} thread_trace_t;
+
+
+
+//
+// Trace dump. The dump is sent to the host as the character THREAD_TRACE_MARKER,
+// the 32-bit length of the data, and the data: the header, the records from oldest
+// to newest and the names of the threads that are still alive.
+//
+#define THREAD_TRACE_MARKER			'\x06'
+#define THREAD_TRACE_MAGIC			0x43525452		// "RTRC"
+
+typedef struct thread_trace_header_t
+{
+	uint32_t	magic;			// THREAD_TRACE_MAGIC
+	uint32_t	record_count;	// Number of records that follow the header
+	uint32_t	name_count;		// Number of names that follow the records
+	uint32_t	reserved;
+	uint64_t	start_cycles;	// Cycle count and system time when the scheduler started,
+	uint64_t	start_time;		// the host derives the clock frequency from these
+	uint64_t	dump_cycles;	// Cycle count and system time of the dump
+	uint64_t	dump_time;
+} thread_trace_header_t;
+
+typedef struct thread_trace_name_t
+{
+	uint32_t	thread_id;
+	char		name[THREAD_NAME_LEN];
+} thread_trace_name_t;
+
+
+
+//
+// Thread structure, only accessible to the scheduler
+//
+typedef struct thread_t thread_t;
+
+
+
+//
+// FIFO of threads. Synchronization objects use it to queue their waiting threads.
+//
+typedef struct thread_queue_t
+{
+	thread_t*		head;
+	thread_t*		tail;
+} thread_queue_t;
+
+
+
 //
 // Thread function
 //
@@ -83,6 +269,13 @@ EXTERN_C void thread_print_list();
 
 
 
+//
+// Send the scheduler trace to the host
+//
+EXTERN_C void thread_trace_dump();
+
+
+
 //
 // Create a thread
 //
@@ -114,6 +307,171 @@ EXTERN_C const char* thread_name(thread_id_t thread_id);
 
 
 
+//
+// Set the priority of a thread, returns whether the priority was set
+//
+// Note: the new priority takes effect the next time the thread is scheduled.
+//
+EXTERN_C uint32_t thread_set_priority(thread_id_t thread_id, uint32_t priority);
+
+
+
+//
+// Get the priority of a thread
+//
+EXTERN_C uint32_t thread_get_priority(thread_id_t thread_id);
+
+
+
+//
+// Set the cores that a thread may run on, returns whether the affinity was set. 
+// New threads inherit the affinity of the thread that creates them. A thread that
+// runs on a core outside the mask moves when it is next switched out.
+//
+EXTERN_C uint32_t thread_set_affinity(thread_id_t thread_id, uint32_t affinity);
+
+
+
+//
+// Get the cores that a thread may run on
+//
+EXTERN_C uint32_t thread_get_affinity(thread_id_t thread_id);
+
+
+
+//
+// Allocate a thread-local storage key, returns 0 when all keys are in use. Every
+// thread has its own value for the key, which is NULL until the thread sets it.
+// When a thread exits, the destructor is called for its non-NULL values.
+//
+// Note: each thread also has its own newlib reentrancy data, so errno and the
+//       stdio state are thread-local without using a key.
+//
+EXTERN_C uint32_t thread_tls_alloc(thread_tls_key_t* key, thread_tls_destructor_t destructor);
+
+
+
+//
+// Free a thread-local storage key
+//
+EXTERN_C void thread_tls_free(thread_tls_key_t key);
+
+
+
+//
+// Set and get the value of a thread-local storage key for the current thread
+//
+EXTERN_C void thread_tls_set(thread_tls_key_t key, void* value);
+EXTERN_C void* thread_tls_get(thread_tls_key_t key);
+
+
+
+//
+// Get the statistics of a thread, returns 0 if the thread does not exist
+//
+EXTERN_C uint32_t thread_get_stats(thread_id_t thread_id, thread_stats_t* stats);
+
+
+
+//
+// Make a thread periodic, releasing a job every period microseconds from now. The
+// job must complete within deadline microseconds of its release, or within the
+// period if deadline is 0. A period of 0 makes the thread aperiodic again.
+//
+// A periodic thread runs its job, then calls thread_wait_period to sleep until the
+// next release.
+//
+EXTERN_C uint32_t thread_set_periodic(thread_id_t thread_id, uint32_t period, uint32_t deadline);
+
+
+
+//
+// Complete the job of the current periodic thread and sleep until the next release.
+// Returns the number of releases that were skipped because the job overran.
+//
+EXTERN_C uint32_t thread_wait_period(void);
+
+
+
+//
+// Get the statistics of a periodic thread, returns 0 if the thread does not exist
+// or is not periodic
+//
+EXTERN_C uint32_t thread_get_period_stats(thread_id_t thread_id, thread_period_stats_t* stats);
+
+
+
+//
+// Enable earliest-deadline-first scheduling. Ready periodic threads of the same 
+// priority run in order of the absolute deadline of their job, ahead of aperiodic
+// threads, and a thread that is released with an earlier deadline preempts the 
+// running thread of its priority when preemption is enabled.
+//
+EXTERN_C void thread_enable_edf(void);
+
+
+
+//
+// Disable earliest-deadline-first scheduling, ready threads of the same priority run
+// in round-robin order
+//
+EXTERN_C void thread_disable_edf(void);
+
+
+
+//
+// Allow or prevent preemption of a thread. Threads are preemptible when created;
+// cooperative threads opt out and only switch when they yield or wait.
+//
+EXTERN_C uint32_t thread_set_preemptible(thread_id_t thread_id, uint32_t preemptible);
+
+
+
+//
+// Enable preemptive time slicing. Threads of the same priority share the CPU in
+// round-robin fashion, each running for at most quantum microseconds at a time.
+// A thread that is made ready by an interrupt preempts lower priority threads.
+//
+EXTERN_C void thread_enable_preemption(uint32_t quantum);
+
+
+
+//
+// Disable preemptive time slicing
+//
+EXTERN_C void thread_disable_preemption(void);
+
+
+
+//
+// Wake threads whose timeout elapsed, and preempt the current thread when a 
+// thread of higher priority is ready or when its quantum elapsed. Called with
+// interrupts disabled at the end of interrupt handling.
+//
+EXTERN_C void thread_preempt(void);
+
+
+
+//
+// Give the current thread its VFP state after it trapped on a VFP instruction,
+// returns 0 if VFP was enabled so the instruction is really undefined. Called
+// from the undefined instruction handler.
+//
+// Note: interrupt handlers must not use VFP. They run on the VFP state of the
+//       thread that they interrupted.
+//
+EXTERN_C uint32_t thread_vfp_trap(void);
+
+
+
+//
+// Sleep thread until an absolute system time. Unlike a relative sleep, a series of
+// sleeps until times at a fixed interval doesn't drift.
+//
+EXTERN_C void thread_sleep_until(sys_time_t time);
+
+
+
 //
 // Sleep thread
 //
@@ -153,3 +511,38 @@ EXTERN_C void thread_yield();
 // Suspend current thread
 //
 EXTERN_C void thread_suspend();
+
+
+
+//
+// Block the current thread on the wait queue of a synchronization object
+//
+// The thread is put in wait_state until it is woken through the queue or its timeout 
+// elapses. Returns the result passed by the waker, or 0 when the wait timed out.
+//
+EXTERN_C uint32_t thread_queue_wait(thread_queue_t* queue, uint32_t wait_state, void* wait_object, sys_time_t timeout);
+
+
+
+//
+// Wake the thread that has waited longest on a wait queue
+//
+// Returns the id of the woken thread, or THREAD_INVALID_ID if there was no waiting thread.
+//
+EXTERN_C thread_id_t thread_queue_wake_one(thread_queue_t* queue, uint32_t result);
+
+
+
+//
+// Wake all threads on a wait queue as one batch, returns the number of threads woken
+//
+EXTERN_C uint32_t thread_queue_wake_all(thread_queue_t* queue, uint32_t result);
+
+
+
+//
+// Move up to count threads from the head of a wait queue to the tail of another, 
+// without waking them. The threads wait in wait_state for wait_object, and their
+// timeouts are cancelled. Returns the number of threads that were moved.
+//
+EXTERN_C uint32_t thread_queue_requeue(thread_queue_t* from, thread_queue_t* to, uint32_t count, uint32_t wait_state, void* wait_object);
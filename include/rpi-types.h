@@ -50,11 +50,22 @@ typedef volatile const uint64_t rpi_wreg_ro_t;
 
 
 
-//#if defined(RPIPLUS)
+#if defined( RPI2 )
+#define PERIPHERAL_BASE     0x3F000000UL
+#else
 #define PERIPHERAL_BASE     0x20000000UL
-//#else
-//#error TODO set peripheral base for other RPi versions
-//#endif
+#endif
+
+
+
+//
+// Number of ARM cores
+//
+#if defined( RPI2 )
+#define RPI_CORE_COUNT		4
+#else
+#define RPI_CORE_COUNT		1
+#endif
 
 
 
@@ -533,6 +544,61 @@ typedef struct {
 
 
 
+#if defined( RPI2 )
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// BCM2836 local peripherals
+//
+////////////////////////////////////////////////////////////////////////////////
+
+
+
+//
+// Base address of the per-core timers, mailboxes and interrupt routing, see the
+// BCM2836 ARM-local peripherals (QA7) documentation
+//
+#define RPI_LOCAL_BASE			0x40000000UL
+
+
+
+//
+// Interrupt sources in the core IRQ source registers
+//
+#define RPI_LOCAL_IRQ_MAILBOX0	(1 << 4)
+
+
+
+//
+// Local peripherals structure. Each core has four mailboxes; writing a mailbox
+// set register sets bits, writing its clear register clears them. A mailbox with
+// any bit set raises an interrupt on its core when enabled in mailbox_irq_control.
+//
+typedef struct {
+	volatile uint32_t control;					// 0x00
+	volatile uint32_t reserved0;				// 0x04
+	volatile uint32_t timer_prescaler;			// 0x08
+	volatile uint32_t gpu_irq_routing;			// 0x0C
+	volatile uint32_t reserved1[12];			// 0x10 - 0x3C
+	volatile uint32_t timer_irq_control[4];		// 0x40, per core
+	volatile uint32_t mailbox_irq_control[4];	// 0x50, per core
+	volatile uint32_t irq_source[4];			// 0x60, per core
+	volatile uint32_t fiq_source[4];			// 0x70, per core
+	volatile uint32_t mailbox_set[4][4];		// 0x80, per core and mailbox
+	volatile uint32_t mailbox_clear[4][4];		// 0xC0, per core and mailbox
+} rpi_local_t;
+
+
+
+//
+// Pointer to the local peripherals
+//
+#define rpi_local ((rpi_local_t*)RPI_LOCAL_BASE)
+
+#endif
+
+
+
 ////////////////////////////////////////////////////////////////////////////////
 //
 // 
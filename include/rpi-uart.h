@@ -20,6 +20,7 @@
 
 #include "rpi-base.h"
 #include "rpi-interrupts.h"
+#include "rpi-systimer.h"
 
 
 //
@@ -33,7 +34,36 @@ EXTERN_C void uart_disable_rx_interrupt();
 
 
 //
-// Input/output functions
+// Interrupt driven receive. After uart_enable_rx_buffer, the RX interrupt moves
+// received bytes into a ring, and uart_read takes them from there. uart_read 
+// waits up to timeout microseconds for data, returns the number of bytes read.
+// From then on, uart_getc and uart_trygetc read from the ring as well. There must
+// be only one reader, a thread or a task.
+//
+EXTERN_C void uart_enable_rx_buffer(void);
+EXTERN_C uint32_t uart_read(void* data, uint32_t len, sys_time_t timeout);
+
+
+
+//
+// Task type, see rpi-task.h
+//
+struct task_t;
+
+
+
+//
+// Queue a task until a byte is received, or until the TX FIFO has space. Used by
+// TASK_UART_GETC and TASK_UART_PUTC, return TASK_WAITING.
+//
+EXTERN_C uint32_t uart_wait_rx_task(struct task_t* task);
+EXTERN_C uint32_t uart_wait_tx_task(struct task_t* task);
+
+
+
+//
+// Input/output functions. Writers sleep while the TX FIFO is full, until the TX
+// interrupt reports that it drained.
 //
 EXTERN_C uint8_t uart_trygetc(uint8_t* byte);
 EXTERN_C uint8_t uart_getc(void);
@@ -43,3 +73,5 @@ EXTERN_C void uart_putc(uint8_t byte);
 
 EXTERN_C void uart_puts_len(const char *str, int len);
 EXTERN_C void uart_puts(const char *str);
+
+EXTERN_C void uart_write(const void* data, int len);
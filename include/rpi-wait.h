@@ -0,0 +1,122 @@
+/*
+	Licensed to the Apache Software Foundation (ASF) under one
+	or more contributor license agreements.  See the NOTICE file
+	distributed with this work for additional information
+	regarding copyright ownership.  The ASF licenses this file
+	to you under the Apache License, Version 2.0 (the
+	"License"); you may not use this file except in compliance
+	with the License.  You may obtain a copy of the License at
+
+	http://www.apache.org/licenses/LICENSE-2.0
+
+	Unless required by applicable law or agreed to in writing,
+	software distributed under the License is distributed on an
+	"AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+	KIND, either express or implied.  See the License for the
+	specific language governing permissions and limitations
+	under the License.
+*/
+#pragma once
+
+#include "rpi-base.h"
+#include "rpi-systimer.h"
+
+
+
+//
+// Waiting for multiple objects
+//
+// A thread that waits for multiple objects links a wait block to each of them.
+// When an object becomes ready and no thread waits for it alone, it notifies
+// the threads on its wait list, which test their objects again. The functions
+// of an object type that test and acquire its objects are in an ops table.
+//
+//	thread_wait_object_t objects[] = { EVENT_WAIT_OBJECT(event), SEM_WAIT_OBJECT(sem) };
+//	uint32_t index = thread_wait_multiple(objects, 2, 0, 1000000);
+//
+
+
+
+//
+// Maximum number of objects that a thread can wait for at once
+//
+#define THREAD_WAIT_MAXIMUM			16
+
+
+
+//
+// Returned by thread_wait_multiple when the timeout elapsed
+//
+#define THREAD_WAIT_TIMEOUT			((uint32_t)-1)
+
+
+
+//
+// Wait block, links a thread that waits for multiple objects to one of them
+//
+struct thread_queue_t;
+typedef struct thread_wait_block_t
+{
+	struct thread_queue_t*			queue;		// Queue on which the waiting thread sleeps
+	struct thread_wait_block_t*		next;
+	struct thread_wait_block_t*		prev;
+} thread_wait_block_t;
+
+
+
+//
+// Wait blocks of the threads that wait for an object, among others
+//
+typedef struct thread_wait_list_t
+{
+	thread_wait_block_t*			head;
+} thread_wait_list_t;
+
+
+
+//
+// Operations of a waitable object type. All are called with interrupts disabled.
+// Types whose objects are only tested, like message queues, have no acquire. 
+// Such an object satisfies a wait for any object while it is ready, and can't be
+// used in a wait for all objects.
+//
+typedef struct thread_wait_ops_t
+{
+	uint32_t (*is_ready)(void* object);					// Whether the current thread can acquire the object
+	uint32_t (*acquire)(void* object);					// Acquire the object if it is ready, returns whether it did, or NULL
+	thread_wait_list_t* (*wait_list)(void* object);		// Wait list of the object
+} thread_wait_ops_t;
+
+
+
+//
+// Object to wait for. The object headers define initializers, like EVENT_WAIT_OBJECT.
+//
+typedef struct thread_wait_object_t
+{
+	const thread_wait_ops_t*		ops;
+	void*							object;
+} thread_wait_object_t;
+
+
+
+//
+// Wait until any or all of a set of objects are ready, and acquire them: an auto
+// event is reset, a mutex is locked, a semaphore is decremented. With wait_all,
+// all objects are acquired at once when all are ready, and 0 is returned. Without,
+// the first ready object in the array is acquired and its index is returned.
+// Returns THREAD_WAIT_TIMEOUT if the timeout elapsed first.
+//
+// Threads that wait for an object alone acquire it before threads that wait for
+// multiple objects. An object may only appear once in the array, and objects that
+// are only tested may not be used with wait_all.
+//
+EXTERN_C uint32_t thread_wait_multiple(const thread_wait_object_t* objects, uint32_t count, uint32_t wait_all, sys_time_t timeout);
+
+
+
+//
+// Wake the threads that wait for multiple objects including an object, so they 
+// test their objects again. Called by the object when it becomes ready.
+//
+EXTERN_C void thread_wait_notify(thread_wait_list_t* list);
@@ -0,0 +1,108 @@
+/*
+	Licensed to the Apache Software Foundation (ASF) under one
+	or more contributor license agreements.  See the NOTICE file
+	distributed with this work for additional information
+	regarding copyright ownership.  The ASF licenses this file
+	to you under the Apache License, Version 2.0 (the
+	"License"); you may not use this file except in compliance
+	with the License.  You may obtain a copy of the License at
+
+	http://www.apache.org/licenses/LICENSE-2.0
+
+	Unless required by applicable law or agreed to in writing,
+	software distributed under the License is distributed on an
+	"AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+	KIND, either express or implied.  See the License for the
+	specific language governing permissions and limitations
+	under the License.
+*/
+#pragma once
+
+#include "rpi-base.h"
+#include "rpi-event.h"
+#include "rpi-systimer.h"
+#include "rpi-thread.h"
+
+
+
+//
+// Work queues
+//
+// A work queue runs work items on a fixed pool of worker threads. A work item is
+// a function and its argument; submitting one is a push on a bounded queue, and 
+// a worker pops it, so a unit of work does not pay for a thread lifecycle.
+//
+//	static void job(void* arg)
+//	{
+//		...
+//	}
+//
+//	workqueue_t* queue = workqueue_create(4 * 1024, "Jobs", THREAD_PRIORITY_DEFAULT, 4, 64);
+//	workqueue_submit(queue, &job, arg, done_event, TIMEOUT_INFINITE);
+//
+
+
+
+//
+// Work queue type
+//
+typedef struct workqueue_t workqueue_t;
+
+
+
+//
+// Work function
+//
+typedef void(*work_fun_t)(void* arg);
+
+
+
+//
+// Work item
+//
+typedef struct work_t
+{
+	work_fun_t		fun;			// Function run by a worker
+	void*			arg;			// Argument passed to the function
+	event_t*		done;			// Signaled when the function returned, or NULL
+} work_t;
+
+
+
+//
+// Create a work queue with thread_count worker threads of a priority, and room for
+// capacity queued work items
+//
+EXTERN_C workqueue_t* workqueue_create(uint32_t stack_size, char const* name, uint32_t priority, uint32_t thread_count, uint32_t capacity);
+
+
+
+//
+// Submit a work item. Waits up to timeout microseconds while the queue is full,
+// returns 0 if the item could not be queued in time.
+//
+EXTERN_C uint32_t workqueue_submit(workqueue_t* queue, work_fun_t fun, void* arg, event_t* done, sys_time_t timeout);
+
+
+
+//
+// Submit a batch of work items, in order. The items are queued with as few 
+// critical sections as the free space allows, and the idle workers are woken
+// once per batch. Waits up to timeout microseconds in total while the queue is 
+// full, returns the number of items that were queued.
+//
+EXTERN_C uint32_t workqueue_submit_batch(workqueue_t* queue, const work_t* items, uint32_t count, sys_time_t timeout);
+
+
+
+//
+// Wait until all submitted work items have completed, returns 0 on timeout
+//
+EXTERN_C uint32_t workqueue_flush(workqueue_t* queue, sys_time_t timeout);
+
+
+
+//
+// Get the number of work items that are queued or running
+//
+EXTERN_C uint32_t workqueue_get_pending(workqueue_t* queue);
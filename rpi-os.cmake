@@ -41,8 +41,18 @@ set( CMAKE_OBJCOPY ${TC_PATH}${CROSS_COMPILE}objcopy
 # Set the CMAKE C flags which will be passed to the C, C++ and ASM compilers
 set( CMAKE_C_FLAGS "${CMAKE_C_FLAGS} -mfpu=vfp" )
 set( CMAKE_C_FLAGS "${CMAKE_C_FLAGS} -mfloat-abi=hard" )
+
+# Build for the RPi 2 (BCM2836, four Cortex-A7 cores) with -DRPI2=ON, otherwise 
+# for the RPi B+. The assembler sources test the RPI2 symbol.
+if( RPI2 )
+set( CMAKE_C_FLAGS "${CMAKE_C_FLAGS} -march=armv7-a" )
+set( CMAKE_C_FLAGS "${CMAKE_C_FLAGS} -mtune=cortex-a7" )
+set( CMAKE_C_FLAGS "${CMAKE_C_FLAGS} -Wa,--defsym,RPI2=1" )
+else()
 set( CMAKE_C_FLAGS "${CMAKE_C_FLAGS} -march=armv6zk" )
 set( CMAKE_C_FLAGS "${CMAKE_C_FLAGS} -mtune=arm1176jzf-s" )
+endif()
+
 set( CMAKE_C_FLAGS "${CMAKE_C_FLAGS} -O3" )
 set( CMAKE_C_FLAGS "${CMAKE_C_FLAGS} -g" )
 set( CMAKE_C_FLAGS "${CMAKE_C_FLAGS} -nostartfiles" )
@@ -60,8 +70,17 @@ set( CMAKE_C_FLAGS   "${CMAKE_C_FLAGS}" CACHE STRING "" )
 set( CMAKE_CXX_FLAGS "${CMAKE_C_FLAGS}" CACHE STRING "" )
 set( CMAKE_ASM_FLAGS "${CMAKE_C_FLAGS}" CACHE STRING "" )
 
-# Set RPIBPLUS as the RPi type
+# Set the RPi type
+if( RPI2 )
+add_definitions( -DRPI2=1 )
+else()
 add_definitions( -DRPIBPLUS=1 )
+endif()
+
+# Run the benchmarks in main.cpp at boot with -DRPI_BENCHMARKS=ON
+if( RPI_BENCHMARKS )
+add_definitions( -DRPI_BENCHMARKS=1 )
+endif()
 
 # Enable _DEBUG
 add_definitions( -D_DEBUG )
@@ -22,17 +22,55 @@
 
 
 
+//
+// ARM Processor Modes (section A2.2)
+//
+.equ    CPSR_MODE_SVR,          0x13
+
+
+
 // Globally visible functions
 .global _get_stack_pointer
 .global _spin
 .global _led_blink
 .global _enable_interrupts
 .global _disable_interrupts
+.global _save_and_disable_interrupts
+.global _restore_interrupts
 .global _get_interrupts
 .global _wait_for_interrupt
 .global _switch_to_thread
+.global _interrupt_entry
+.global _undefined_entry
+.global _get_fpexc
+.global _set_fpexc
+.global _vfp_save
+.global _vfp_load
+.global _enable_cycle_counter
+.global _get_cycle_count
 .global _isb
-.global _dsb
+.global _dmb
+.global _get_core_id
+.global _kernel_lock
+.global _kernel_unlock
+.global _send_event
+.global _mmu_enable
+
+
+
+//
+// Kernel lock, holds the id of the owning core plus one, or zero when free
+//
+// On multi-core builds, the critical sections of _save_and_disable_interrupts and
+// _restore_interrupts also hold the kernel lock, so a critical section excludes
+// the other cores as well as interrupts. Only the outermost section takes the lock:
+// a core that runs with interrupts disabled in the kernel always holds it.
+//
+.section ".bss"
+.balign 4
+kernel_lock_owner:
+	.word	0
+.section ".text.functions"
 
 
 
@@ -62,7 +100,11 @@ _spin:
 // extern void _led_blink();
 //
 _led_blink:
+.ifdef RPI2
+	ldr		r0,=0x3F200000
+.else
 	ldr		r0,=0x20200000
+.endif
 	mov		r1,#0x8000
 	str		r1,[r0,#32]
 	mov		r1, #0x100000
@@ -82,6 +124,21 @@ _wait_2:
 // extern uint32_t _enable_interrupts(uint32_t mode);
 //
 _enable_interrupts:
+.ifdef RPI2
+	mrc		p15, 0, r1, c0, c0, 5		// Release the kernel lock if this core holds it
+	and		r1, r1, #3
+	add		r1, r1, #1
+	ldr		r2, =kernel_lock_owner
+	ldr		r3, [r2]
+	cmp		r3, r1
+	bne		1f
+	mov		r3, #0
+	dmb
+	str		r3, [r2]
+	dsb
+	sev
+1:
+.endif
     mrs     r0, cpsr			// Store current mode in r1
     bic     r0, r0, #0xC0		// Add new mode into r2
     msr     cpsr_c, r0			// Enable new mode from r2
@@ -102,6 +159,115 @@ _disable_interrupts:
 
 
 
+//
+// Disable interrupts. Returns the previous state for _restore_interrupts.
+//
+// extern uint32_t _save_and_disable_interrupts(void);
+//
+_save_and_disable_interrupts:
+	mrs		r0, cpsr
+	cpsid	if
+.ifdef RPI2
+	tst		r0, #0x80					// Take the kernel lock in the outermost section
+	beq		_kernel_lock
+.endif
+	bx		lr
+
+
+
+//
+// Restore the interrupt state returned by _save_and_disable_interrupts
+//
+// extern void _restore_interrupts(uint32_t state);
+//
+_restore_interrupts:
+.ifdef RPI2
+	tst		r0, #0x80					// Release the kernel lock when leaving the outermost section
+	bne		1f
+	mov		r1, #0
+	ldr		r2, =kernel_lock_owner
+	dmb
+	str		r1, [r2]
+	dsb
+	sev
+1:
+.endif
+	msr		cpsr_c, r0
+	bx		lr
+
+
+
+//
+// Take the kernel lock, must be called with interrupts disabled. Preserves r0.
+//
+// extern void _kernel_lock(void);
+//
+_kernel_lock:
+.ifdef RPI2
+	mrc		p15, 0, r1, c0, c0, 5		// The owner value is the core id plus one
+	and		r1, r1, #3
+	add		r1, r1, #1
+	ldr		r2, =kernel_lock_owner
+1:
+	ldrex	r3, [r2]
+	cmp		r3, #0						// Wait for an event while the lock is taken
+	wfene
+	bne		1b
+	strex	r3, r1, [r2]
+	cmp		r3, #0
+	bne		1b
+	dmb
+.endif
+	bx		lr
+
+
+
+//
+// Release the kernel lock, leaving interrupts disabled
+//
+// extern void _kernel_unlock(void);
+//
+_kernel_unlock:
+.ifdef RPI2
+	mov		r1, #0
+	ldr		r2, =kernel_lock_owner
+	dmb
+	str		r1, [r2]
+	dsb
+	sev
+.endif
+	bx		lr
+
+
+
+//
+// Get the id of the core that runs the caller
+//
+// extern uint32_t _get_core_id(void);
+//
+_get_core_id:
+.ifdef RPI2
+	mrc		p15, 0, r0, c0, c0, 5		// MPIDR
+	and		r0, r0, #3
+.else
+	mov		r0, #0
+.endif
+	bx		lr
+
+
+
+//
+// Wake cores that wait for an event
+//
+// extern void _send_event(void);
+//
+_send_event:
+	mcr		p15, 0, r0, c7, c10, 4		// Data synchronization barrier
+	sev
+	bx		lr
+
+
+
 //
 // Get enabled interrupts
 //
@@ -119,7 +285,12 @@ _get_interrupts:
 // extern void _wait_for_interrupt(void);
 //
 _wait_for_interrupt:
+.ifdef RPI2
+	dsb
+	wfi
+.else
 	mcr		p15, 0, R0, c7, c0, 4
+.endif
 	bx		lr
 
 
@@ -127,14 +298,186 @@ _wait_for_interrupt:
 //
 // Switch from one thread to another
 //
-// Note that the return value must be set through new_regs, it is not set by the code below
+// Only the callee-saved registers r4-r11, sp and lr are saved, the caller has saved
+// the others. The return value is loaded from the word that follows them in new_regs.
 //
 // extern uint32_t _switch_to_thread(uint32_t* cur_regs, uint32_t* new_regs);
 //
 _switch_to_thread:
-	stmia	r0, {r0-r14}
-	ldmia	r1, {r0-r14}
-	bx	lr
+	stmia	r0, {r4-r11, sp, lr}
+	ldmia	r1, {r4-r11, sp, lr}
+	ldr		r0, [r1, #40]
+	bx		lr
+
+
+
+//
+// IRQ entry
+//
+// The interrupted context is saved on the supervisor stack of the interrupted thread 
+// rather than on the IRQ stack. The handler runs in supervisor mode with interrupts
+// disabled, so the scheduler can switch away from the interrupted thread inside the 
+// handler and resume it later by simply returning here.
+//
+_interrupt_entry:
+	sub		lr, lr, #4					// Return to the interrupted instruction
+	srsdb	sp!, #CPSR_MODE_SVR			// Push return address and spsr on the supervisor stack
+	cps		#CPSR_MODE_SVR				// Continue in supervisor mode
+	push	{r0-r3, r12, lr}			// Save the registers the handler may clobber
+	and		r1, sp, #4					// Align the stack to 8 bytes
+	sub		sp, sp, r1
+	push	{r1, r2}
+.ifdef RPI2
+	bl		_kernel_lock				// Interrupts were enabled, so the lock isn't held yet
+.endif
+	bl		interrupt_vector
+.ifdef RPI2
+	bl		_kernel_unlock
+.endif
+	pop		{r1, r2}
+	add		sp, sp, r1
+	pop		{r0-r3, r12, lr}
+	rfeia	sp!							// Return to the interrupted context
+
+
+
+//
+// Undefined instruction entry
+//
+// Like the IRQ entry, the context is saved on the supervisor stack. VFP instructions 
+// trap here while VFP is disabled; when the handler has enabled VFP and loaded the 
+// state of the current thread, the instruction is retried.
+//
+_undefined_entry:
+	sub		lr, lr, #4					// Return to the undefined instruction
+	srsdb	sp!, #CPSR_MODE_SVR			// Push return address and spsr on the supervisor stack
+	cps		#CPSR_MODE_SVR				// Continue in supervisor mode
+	push	{r0-r3, r12, lr}			// Save the registers the handler may clobber
+	and		r1, sp, #4					// Align the stack to 8 bytes
+	sub		sp, sp, r1
+	push	{r1, r2}
+	bl		undefined_instruction_vector
+	pop		{r1, r2}
+	add		sp, sp, r1
+	pop		{r0-r3, r12, lr}
+	rfeia	sp!							// Retry the instruction
+
+
+
+//
+// Get the VFP exception register
+//
+// extern uint32_t _get_fpexc(void);
+//
+_get_fpexc:
+	fmrx	r0, fpexc
+	bx		lr
+
+
+
+//
+// Set the VFP exception register
+//
+// extern void _set_fpexc(uint32_t fpexc);
+//
+_set_fpexc:
+	fmxr	fpexc, r0
+	bx		lr
+
+
+
+//
+// Save d0-d15 and fpscr
+//
+// extern void _vfp_save(uint32_t* state);
+//
+_vfp_save:
+	fstmiad	r0!, {d0-d15}
+	fmrx	r1, fpscr
+	str		r1, [r0]
+	bx		lr
+
+
+
+//
+// Load d0-d15 and fpscr
+//
+// extern void _vfp_load(uint32_t* state);
+//
+_vfp_load:
+	fldmiad	r0!, {d0-d15}
+	ldr		r1, [r0]
+	fmxr	fpscr, r1
+	bx		lr
+
+
+
+//
+// Start the cycle counter of the ARM1176 or Cortex-A7 performance monitor
+//
+// extern void _enable_cycle_counter(void);
+//
+_enable_cycle_counter:
+.ifdef RPI2
+	mrc		p15, 0, r0, c9, c12, 0		// Read PMCR
+	orr		r0, r0, #1					// Enable the counters
+	bic		r0, r0, #8					// Count every cycle rather than every 64th
+	mcr		p15, 0, r0, c9, c12, 0
+	mov		r0, #0x80000000				// Enable the cycle counter in PMCNTENSET
+	mcr		p15, 0, r0, c9, c12, 1
+.else
+	mrc		p15, 0, r0, c15, c12, 0		// Read the performance monitor control register
+	orr		r0, r0, #1					// Enable the counters
+	bic		r0, r0, #8					// Count every cycle rather than every 64th
+	mcr		p15, 0, r0, c15, c12, 0
+.endif
+	bx		lr
+
+
+
+//
+// Read the cycle counter
+//
+// extern uint32_t _get_cycle_count(void);
+//
+_get_cycle_count:
+.ifdef RPI2
+	mrc		p15, 0, r0, c9, c13, 0		// PMCCNTR
+.else
+	mrc		p15, 0, r0, c15, c12, 1
+.endif
+	bx		lr
+
+
+
+//
+// Enable the MMU with a flat section translation table, and the caches. The core
+// joins the coherency domain of the other cores first. Exclusive loads and stores,
+// and so the kernel lock, only work on cacheable memory on the Cortex-A7.
+//
+// extern void _mmu_enable(uint32_t* table);
+//
+_mmu_enable:
+.ifdef RPI2
+	mrc		p15, 0, r1, c1, c0, 1		// Set the SMP bit in ACTLR
+	orr		r1, r1, #(1 << 6)
+	mcr		p15, 0, r1, c1, c0, 1
+	mov		r1, #0
+	mcr		p15, 0, r1, c8, c7, 0		// Invalidate the TLBs
+	mcr		p15, 0, r1, c2, c0, 2		// TTBCR: use TTBR0 only
+	orr		r0, r0, #0x4A				// TTBR0: inner and outer write-back, shareable walks
+	mcr		p15, 0, r0, c2, c0, 0
+	mov		r1, #1						// Domain 0 is a client domain
+	mcr		p15, 0, r1, c3, c0, 0
+	dsb
+	isb
+	mrc		p15, 0, r1, c1, c0, 0		// SCTLR: enable the MMU, caches and branch prediction
+	ldr		r2, =0x1805
+	orr		r1, r1, r2
+	mcr		p15, 0, r1, c1, c0, 0
+	isb
+.endif
+	bx		lr
 
 
 
@@ -65,6 +65,10 @@ extern int errno;
 /* Prototype for the UART write function */
 #include "rpi-uart.h"
 
+/* Required includes for the malloc lock */
+#include <stdint.h>
+#include <reent.h>
+
 /* A pointer to a list of environment variables and their values. For a minimal
 environment, this empty list is adequate: */
 char *__env[1] = { 0 };
@@ -257,3 +261,28 @@ int _write(int file, char *ptr, int len)
 	uart_puts_len(ptr, len);
 	return len;
 }
+
+
+/* Lock the malloc arena. Threads can be preempted, so newlib's allocator must
+be protected. The lock is recursive because newlib takes it again from within
+malloc; interrupts are disabled on the outermost lock and restored on the
+outermost unlock. */
+extern uint32_t _save_and_disable_interrupts(void);
+extern void _restore_interrupts(uint32_t state);
+
+static uint32_t malloc_lock_count;
+static uint32_t malloc_lock_irq;
+
+void __malloc_lock(struct _reent *reent)
+{
+	uint32_t irq = _save_and_disable_interrupts();
+	if (malloc_lock_count++ == 0)
+		malloc_lock_irq = irq;
+}
+
+
+void __malloc_unlock(struct _reent *reent)
+{
+	if (--malloc_lock_count == 0)
+		_restore_interrupts(malloc_lock_irq);
+}
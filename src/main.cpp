@@ -22,6 +22,8 @@
 #include "rpi-systimer.h"
 #include "rpi-mailbox-interface.h"
 #include "rpi-thread.h"
+#include "rpi-task.h"
+#include "rpi-workqueue.h"
 #include "asm-functions.h"
 
 #include <stdio.h>
@@ -52,23 +54,34 @@ void led_thread(uint32_t thread_arg)
 
 
 //
-// A thread that monitors the uart for input, then echos it back
+// A thread that waits for uart input, then echos it back. The host 
+// requests the scheduler trace by sending the trace marker.
 //
 static void uart_thread(uint32_t thread_arg)
 {
-	uint8_t ch;
+	uint8_t buf[16];
+
+	// Let the RX interrupt pass received bytes to this thread
+	uart_enable_rx_buffer();
 
 	while (1)
 	{
-		while (!uart_trygetc(&ch))
-			thread_sleep_msec(1);
-
-		while (!uart_tryputc(ch))
-			thread_yield();
-
-		if (ch == '\r')
-			while (!uart_tryputc('\n'))
-				thread_yield();
+		uint32_t count = uart_read(buf, sizeof(buf), TIMEOUT_INFINITE);
+		for (uint32_t i = 0; i < count; i++)
+		{
+			uint8_t ch = buf[i];
+			if (ch == THREAD_TRACE_MARKER)
+			{
+				thread_trace_dump();
+				continue;
+			}
+
+			// Sleep while the TX FIFO is full, so this thread does not
+			// starve the lower priority threads
+			uart_putc(ch);
+			if (ch == '\r')
+				uart_putc('\n');
+		}
 	}
 }
 
@@ -83,12 +96,11 @@ static void uart_thread(uint32_t thread_arg)
 //
 static void time_thread(uint32_t thread_arg)
 {
-	uint32_t time_us = rpi_sys_timer->clo;
+	thread_set_periodic(thread_get_id(), 1000000, 0);
 	while (1)
 	{
 		thread_print_list();
-		thread_sleep_usec(1000000 - (rpi_sys_timer->clo - time_us));
-		time_us += 1000000;
+		thread_wait_period();
 	}
 }
 
@@ -98,45 +110,245 @@ static void time_thread(uint32_t thread_arg)
 
 
 
-static uint32_t thread_counter = 0;
-static void worker_thread(uint32_t);
+static uint32_t job_counter = 0;
+static void worker_job(void*);
+
+
+
+//
+// Worker load, keeps the CPU busy for a number of iterations
+//
+static int worker_load(int iterations)
+{
+	int result = 0;
+	for (int i = 1; i < iterations; i++)
+	{
+		result += i;
+		result /= i;
+		result %= 1;
+	}
+	return result;
+}
+
 
 static mutex_t* test_mutex;
+static workqueue_t* worker_pool;
+
+//
+// Number of worker jobs, and of the pool threads that run them
+//
+#define WORKER_COUNT			15
+
 
-void create_worker()
+
+void submit_worker()
 {
-	char buf[20];
-	sprintf(buf, "Worker %u", thread_counter);
-	thread_create(4 * 1024, buf, worker_thread, thread_counter++);
+	workqueue_submit(worker_pool, &worker_job, (void*)job_counter++, NULL, TIMEOUT_INFINITE);
 }
 
 
 
-static void worker_thread(uint32_t thread_arg)
+static void worker_job(void* arg)
 {
 	uint32_t locked = mutex_lock(test_mutex, 10000000);
 
-	int result = 0;
-	
 	for (int l = 0; l < 2500; l++)
 	{
-		for (int i = 1; i < 2500000; i++)
-		{
-			result += i;
-			result /= i;
-			result %= 1;
-		}
+		worker_load(2500000);
 		thread_sleep_usec(750);
 	}
 
 	if (locked)
 		mutex_unlock(test_mutex);
 
-	create_worker();
+	submit_worker();
+}
+
+
+
+//////////////////////////////////////////////////////////////////////////
+
+
+
+#if defined( RPI2 ) && defined( RPI_BENCHMARKS )
+
+//
+// Worker benchmark. Runs the same set of worker jobs on 1 to 4 cores, and prints 
+// the throughput and the speedup over a single core.
+//
+#define BENCH_WORKERS			16
+#define BENCH_JOBS				10
+#define BENCH_ITERATIONS		250000
+
+static volatile int bench_result;
+static volatile uint32_t bench_remaining;
+static event_t* bench_done;
+
+
+
+static void bench_worker_thread(uint32_t thread_arg)
+{
+	int result = 0;
+	for (int job = 0; job < BENCH_JOBS; job++)
+		result += worker_load(BENCH_ITERATIONS);
+	bench_result = result;
+
+	// The last worker to finish ends the run
+	uint32_t irq = _save_and_disable_interrupts();
+	uint32_t last = --bench_remaining == 0;
+	_restore_interrupts(irq);
+	if (last)
+		event_signal(bench_done);
+}
+
+
+
+static void run_worker_benchmark()
+{
+	char buf[100];
+	bench_done = event_create("bench_done", EVENT_TYPE_AUTO);
+
+	sys_time_t single = 0;
+	for (uint32_t core_count = 1; core_count <= RPI_CORE_COUNT; core_count++)
+	{
+		// The workers inherit the affinity of this thread, which limits them to the
+		// first core_count cores. Idle cores steal the workers from the core that
+		// creates them.
+		thread_set_affinity(thread_get_id(), (1u << core_count) - 1);
+
+		bench_remaining = BENCH_WORKERS;
+		sys_time_t start = sys_timer_get_time();
+		for (uint32_t i = 0; i < BENCH_WORKERS; i++)
+			thread_create(4 * 1024, "Bench worker", &bench_worker_thread, i);
+		event_wait(bench_done, TIMEOUT_INFINITE);
+		sys_time_t elapsed = sys_timer_get_time() - start;
+
+		if (core_count == 1)
+			single = elapsed;
+
+		uint32_t jobs = BENCH_WORKERS * BENCH_JOBS;
+		uint32_t speedup = (uint32_t)(single * 100 / elapsed);
+		sprintf(buf, "Workers on %u core(s): %u jobs in %u msec, %u jobs/sec, speedup %u.%02u\n",
+			core_count, jobs, (uint32_t)(elapsed / 1000), (uint32_t)(jobs * 1000000ULL / elapsed), 
+			speedup / 100, speedup % 100);
+		uart_puts(buf);
+	}
+
+	thread_set_affinity(thread_get_id(), THREAD_AFFINITY_ALL);
+	event_destroy(bench_done);
+}
+
+#endif
+
+
+
+//////////////////////////////////////////////////////////////////////////
+
+
+
+#if defined( RPI_BENCHMARKS )
+
+//
+// Fan-out benchmark. Releases a group of waiting threads with one signal of a 
+// manual event, and with one signal of an auto event per thread, and prints the
+// time from the first signal until each thread runs.
+//
+#define FANOUT_WAITERS			16
+#define FANOUT_ROUNDS			10
+
+static event_t* fanout_go;
+static event_t* fanout_ready;
+static event_t* fanout_done;
+static volatile uint32_t fanout_blocking;
+static volatile uint32_t fanout_remaining;
+static volatile sys_time_t fanout_start;
+static volatile sys_time_t fanout_total;
+static volatile sys_time_t fanout_max;
+
+
+
+static void fanout_waiter_thread(uint32_t thread_arg)
+{
+	// The last waiter to block releases the benchmark thread. It is counted in
+	// the same critical section in which it blocks, so the go signal can't
+	// come before all waiters are on the event.
+	uint32_t irq = _save_and_disable_interrupts();
+	if (--fanout_blocking == 0)
+		event_signal(fanout_ready);
+	event_wait(fanout_go, TIMEOUT_INFINITE);
+	_restore_interrupts(irq);
+
+	sys_time_t latency = sys_timer_get_time() - fanout_start;
+
+	// The last waiter to run ends the round
+	irq = _save_and_disable_interrupts();
+	fanout_total += latency;
+	if (latency > fanout_max)
+		fanout_max = latency;
+	uint32_t last = --fanout_remaining == 0;
+	_restore_interrupts(irq);
+	if (last)
+		event_signal(fanout_done);
+}
+
+
+
+static void run_fanout_round(event_type_t type, char const* name)
+{
+	char buf[100];
+	fanout_go = event_create(name, type);
+	fanout_total = 0;
+	fanout_max = 0;
+
+	for (uint32_t round = 0; round < FANOUT_ROUNDS; round++)
+	{
+		// Let all waiters block before the signal
+		fanout_blocking = FANOUT_WAITERS;
+		fanout_remaining = FANOUT_WAITERS;
+		for (uint32_t i = 0; i < FANOUT_WAITERS; i++)
+			thread_create(4 * 1024, "Fanout waiter", &fanout_waiter_thread, i);
+		event_wait(fanout_ready, TIMEOUT_INFINITE);
+
+		fanout_start = sys_timer_get_time();
+		if (type == EVENT_TYPE_MANUAL)
+		{
+			event_signal(fanout_go);
+		}
+		else
+		{
+			for (uint32_t i = 0; i < FANOUT_WAITERS; i++)
+				event_signal(fanout_go);
+		}
+		event_wait(fanout_done, TIMEOUT_INFINITE);
+
+		if (type == EVENT_TYPE_MANUAL)
+			event_reset(fanout_go);
+	}
+
+	event_destroy(fanout_go);
+
+	uint32_t wakeups = FANOUT_WAITERS * FANOUT_ROUNDS;
+	sprintf(buf, "Fan-out to %u threads, %s event: average %u usec, maximum %u usec\n",
+		FANOUT_WAITERS, name, (uint32_t)(fanout_total / wakeups), (uint32_t)fanout_max);
+	uart_puts(buf);
 }
 
 
 
+static void run_fanout_benchmark()
+{
+	fanout_ready = event_create("fanout_ready", EVENT_TYPE_AUTO);
+	fanout_done = event_create("fanout_done", EVENT_TYPE_AUTO);
+	run_fanout_round(EVENT_TYPE_MANUAL, "manual");
+	run_fanout_round(EVENT_TYPE_AUTO, "auto");
+	event_destroy(fanout_done);
+	event_destroy(fanout_ready);
+}
+
+#endif
+
+
+
 //////////////////////////////////////////////////////////////////////////
 
 
@@ -168,6 +380,24 @@ static void consumer_thread(uint32_t thread_arg)
 }
 
 
+
+//
+// Consumer tasks, equivalent to the consumer threads but sharing one thread
+//
+static task_t consumer_tasks[20];
+
+static uint32_t consumer_task(task_t* task)
+{
+	TASK_BEGIN(task);
+	while (1)
+	{
+		TASK_WAIT_EVENT(task, test_event, TIMEOUT_INFINITE);
+		TASK_SLEEP(task, 5000000);
+	}
+	TASK_END(task);
+}
+
+
 //////////////////////////////////////////////////////////////////////////
 
 
@@ -176,13 +406,25 @@ static void consumer_thread(uint32_t thread_arg)
 //
 extern "C" void rpi_main(uint32_t thread_arg)
 {
+#if defined( RPI2 ) && defined( RPI_BENCHMARKS )
+	// Measure how the worker throughput scales with the number of cores
+	run_worker_benchmark();
+#endif
+
+#if defined( RPI_BENCHMARKS )
+	// Measure how long releasing a group of waiting threads takes
+	run_fanout_benchmark();
+#endif
+
 	test_mutex = mutex_create("test_mutex");
 
 	// Create a led blink timer
 	thread_create(4 * 1024, "LED thread", &led_thread, 0);
 	
-	// Create a thread that monitors the UART for incoming data
-	thread_create(4 * 1024, "UART thread", &uart_thread, 0);
+	// Create a thread that monitors the UART for incoming data. It runs above
+	// the default priority so input is echoed even when the workers are busy.
+	thread_id_t uart_thread_id = thread_create(4 * 1024, "UART thread", &uart_thread, 0);
+	thread_set_priority(uart_thread_id, THREAD_PRIORITY_DEFAULT + 8);
 
 	// Create a time trace thread
 	thread_create(4 * 1024, "Time thread", &time_thread, 0);
@@ -196,13 +438,23 @@ extern "C" void rpi_main(uint32_t thread_arg)
 		thread_sleep_usec(5000);
 	}
 
-	// Create some worker threads
-	for (int i = 0; i < 15; i++)
+	// Create a task runner with consumer tasks
+	task_runner_t* runner = task_runner_create(4 * 1024, "Task runner", THREAD_PRIORITY_DEFAULT);
+	for (uint32_t i = 0; i < sizeof(consumer_tasks) / sizeof(consumer_tasks[0]); i++)
+		task_start(runner, &consumer_tasks[i], &consumer_task, NULL);
+
+	// Create a worker pool and submit some jobs, each job submits its successor
+	worker_pool = workqueue_create(4 * 1024, "Worker", THREAD_PRIORITY_DEFAULT, WORKER_COUNT, WORKER_COUNT);
+	for (int i = 0; i < WORKER_COUNT; i++)
 	{
-		create_worker();
+		submit_worker();
 		thread_sleep_usec(5000);
 	}
 
+	// Let threads of equal priority share the CPU in 10 msec slices, 
+	// so the busy workers can't starve each other
+	thread_enable_preemption(10000);
+
 	// Suspend the main thread
 	thread_suspend();
 
@@ -23,19 +23,48 @@
 #include "asm-functions.h"
 
 
+//
+// The ARM timer runs from the 250 MHz APB clock, divide it down to 1 MHz
+// so the load register counts in microseconds
+//
+#define ARM_TIMER_PREDIVIDER	249
+
+
+
+//
+// Handler invoked when the timer elapses
+//
+static irq_handler_t arm_timer_handler = NULL;
+
+
+
+//
+// Current interval
+//
+static uint32_t arm_timer_interval = 0;
+
+
+
 //
 // Enable the ARM timer
 //
-void arm_timer_enable(uint32_t interval)
+void arm_timer_enable(uint32_t interval, irq_handler_t handler)
 {
-	// Disable interrupts
-	_disable_interrupts();
+	// Disable interrupts, the caller may already have
+	uint32_t irq = _save_and_disable_interrupts();
+
+	// Store handler and interval
+	arm_timer_handler = handler;
+	arm_timer_interval = interval;
 
 	// Clear all pending interrupts
 	rpi_arm_timer->irq_clear = 1;
 
+	// Count in microseconds
+	rpi_arm_timer->pre_devider = ARM_TIMER_PREDIVIDER;
+
 	// Set timer interval
-	rpi_arm_timer->load = 0x400;
+	rpi_arm_timer->load = interval;
 
 	// Setup control flags and enable
 	rpi_arm_timer->control =
@@ -44,8 +73,22 @@ void arm_timer_enable(uint32_t interval)
 		RPI_ARMTIMER_CTRL_INT_ENABLE |
 		RPI_ARMTIMER_CTRL_PRESCALE_1;
 
-	// Enable previous interrupt mode
-	_enable_interrupts();
+	// Enable the timer interrupt
+	rpi_irq_controller->enable_basic_irqs = RPI_BASIC_ARM_TIMER_IRQ;
+
+	// Restore the previous interrupt state
+	_restore_interrupts(irq);
+}
+
+
+
+//
+// Restart the current interval from the beginning
+//
+void arm_timer_restart(void)
+{
+	// Writing the load register reloads the timer value immediately
+	rpi_arm_timer->load = arm_timer_interval;
 }
 
 
@@ -55,8 +98,8 @@ void arm_timer_enable(uint32_t interval)
 //
 void arm_timer_disable(void)
 {
-	// Disable interrupts
-	_disable_interrupts();
+	// Disable interrupts, the caller may already have
+	uint32_t irq = _save_and_disable_interrupts();
 
 	// Clear all pending interrupts
 	rpi_arm_timer->irq_clear = 1;
@@ -66,12 +109,14 @@ void arm_timer_disable(void)
 
 	// Clear timer interval
 	rpi_arm_timer->load = 0;
+	arm_timer_interval = 0;
+	arm_timer_handler = NULL;
 
 	// Disable the timer interrupt
 	rpi_irq_controller->disable_basic_irqs = RPI_BASIC_ARM_TIMER_IRQ;
 
-	// Enable previous interrupt mode
-	_enable_interrupts();
+	// Restore the previous interrupt state
+	_restore_interrupts(irq);
 }
 
 
@@ -83,4 +128,8 @@ void arm_timer_interrupt(void)
 {
 	// Clear the pending interrupt flag
 	rpi_arm_timer->irq_clear = 1;
+
+	// Invoke the handler
+	if (arm_timer_handler != NULL)
+		arm_timer_handler();
 }
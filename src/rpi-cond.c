@@ -0,0 +1,134 @@
+/*
+	Licensed to the Apache Software Foundation (ASF) under one
+	or more contributor license agreements.  See the NOTICE file
+	distributed with this work for additional information
+	regarding copyright ownership.  The ASF licenses this file
+	to you under the Apache License, Version 2.0 (the
+	"License"); you may not use this file except in compliance
+	with the License.  You may obtain a copy of the License at
+
+	http://www.apache.org/licenses/LICENSE-2.0
+
+	Unless required by applicable law or agreed to in writing,
+	software distributed under the License is distributed on an
+	"AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+	KIND, either express or implied.  See the License for the
+	specific language governing permissions and limitations
+	under the License.
+*/
+#include "rpi-cond.h"
+#include "rpi-thread.h"
+#include "asm-functions.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <malloc.h>
+#include <stdio.h>
+
+
+
+//
+// Condition variable structure
+//
+struct cond_t
+{
+	mutex_t*		mutex;					// Mutex of the waiting threads
+	thread_queue_t	waiters;				// Threads waiting for the condition, in arrival order
+	char			name[COND_NAME_LEN];	// Condition variable name
+};
+
+
+
+//
+// Create a condition variable
+//
+cond_t* cond_create(const char* name)
+{
+	// Create and initialize condition variable
+	cond_t* cond = (cond_t*)malloc(sizeof(cond_t));
+	memset(cond, 0, sizeof(cond_t));
+
+	// Copy condition variable name
+	strncpy(cond->name, name, COND_NAME_LEN);
+	cond->name[COND_NAME_LEN - 1] = '\x0';
+
+	return cond;
+}
+
+
+
+//
+// Destroy a condition variable
+//
+void cond_destroy(cond_t* cond)
+{
+	ASSERT(cond->waiters.head == NULL);
+	free(cond);
+}
+
+
+
+//
+// Get condition variable name
+//
+const char* cond_get_name(cond_t* cond)
+{
+	return cond->name;
+}
+
+
+
+//
+// Wait for a condition
+//
+uint32_t cond_wait(cond_t* cond, mutex_t* mutex, sys_time_t timeout)
+{
+	ASSERT(thread_get_id() != THREAD_SCHEDULER_THREAD_ID);
+
+	// Release the mutex and start waiting without being interrupted, so a
+	// signal can't be missed in between
+	uint32_t irq = _save_and_disable_interrupts();
+
+	ASSERT(cond->waiters.head == NULL || cond->mutex == mutex);
+	cond->mutex = mutex;
+
+	uint32_t count = mutex_release(mutex);
+	uint32_t result = thread_queue_wait(&cond->waiters, THREAD_STATE_COND_WAIT, cond, timeout);
+
+	// A signaled thread was woken as the owner of the mutex, a thread whose 
+	// wait timed out locks the mutex again itself
+	mutex_reacquire(mutex, count);
+
+	_restore_interrupts(irq);
+	return result;
+}
+
+
+
+//
+// Wake the longest waiting thread
+//
+void cond_signal(cond_t* cond)
+{
+	uint32_t irq = _save_and_disable_interrupts();
+
+	if (cond->waiters.head != NULL)
+		mutex_requeue(cond->mutex, &cond->waiters, 1);
+
+	_restore_interrupts(irq);
+}
+
+
+
+//
+// Wake all waiting threads
+//
+void cond_broadcast(cond_t* cond)
+{
+	uint32_t irq = _save_and_disable_interrupts();
+
+	if (cond->waiters.head != NULL)
+		mutex_requeue(cond->mutex, &cond->waiters, UINT32_MAX);
+
+	_restore_interrupts(irq);
+}
@@ -18,6 +18,8 @@
 */
 #include "rpi-event.h"
 #include "rpi-thread.h"
+#include "rpi-task.h"
+#include "asm-functions.h"
 
 #include <stdlib.h>
 #include <string.h>
@@ -34,7 +36,9 @@ struct event_t
 	event_type_t		type;					// Event type
 	char				name[EVENT_NAME_LEN];	// Event name
 	uint32_t			count;					// Event signal count
-	uint32_t			waits;					// Number of waiting threads
+	thread_queue_t		waiters;				// Threads waiting for the event, in arrival order
+	task_queue_t		tasks;					// Tasks waiting for the event, in arrival order
+	thread_wait_list_t	wait_list;				// Threads waiting for the event among other objects
 };
 
 
@@ -50,7 +54,11 @@ event_t* event_create(const char* name, event_type_t type)
 	// Set event properties
 	event->type = type;
 	event->count = 0;
-	event->waits = 0;
+	event->waiters.head = NULL;
+	event->waiters.tail = NULL;
+	event->tasks.head = NULL;
+	event->tasks.tail = NULL;
+	event->wait_list.head = NULL;
 
 	// Copy event name
 	strncpy(event->name, name, EVENT_NAME_LEN);
@@ -66,7 +74,9 @@ event_t* event_create(const char* name, event_type_t type)
 //
 void event_destroy(event_t* event)
 {
-	ASSERT(event->waits == 0);
+	ASSERT(event->waiters.head == NULL);
+	ASSERT(event->tasks.head == NULL);
+	ASSERT(event->wait_list.head == NULL);
 	free(event);
 }
 
@@ -87,8 +97,36 @@ const char* event_get_name(event_t* event)
 //
 void event_signal(event_t* event)
 {
+	// Events may be signaled from interrupt handlers
+	uint32_t irq = _save_and_disable_interrupts();
+
+	if (event->type == EVENT_TYPE_AUTO)
+	{
+		// Hand the signal directly to the longest waiting thread, or else
+		// to the longest waiting task. Only keep it when nobody is waiting.
+		if (thread_queue_wake_one(&event->waiters, 1) != THREAD_INVALID_ID ||
+			task_queue_wake_one(&event->tasks, 1) != NULL)
+		{
+			_restore_interrupts(irq);
+			return;
+		}
+	}
+	else
+	{
+		// Release all waiting threads and tasks in one batch. The event stays 
+		// signaled, so later waits pass until it is reset.
+		thread_queue_wake_all(&event->waiters, 1);
+		task_queue_wake_all(&event->tasks, 1);
+		event->count = 0;
+	}
+
 	ASSERT(event->count < UINT32_MAX);
 	event->count++;
+
+	// Let threads that wait for multiple objects take the signal
+	thread_wait_notify(&event->wait_list);
+
+	_restore_interrupts(irq);
 }
 
 
@@ -100,6 +138,8 @@ void event_signal(event_t* event)
 //
 void event_reset(event_t* event)
 {
+	uint32_t irq = _save_and_disable_interrupts();
+
 	if (event->type == EVENT_TYPE_AUTO)
 	{
 		ASSERT(event->count != 0);
@@ -109,6 +149,8 @@ void event_reset(event_t* event)
 	{
 		event->count = 0;
 	}
+
+	_restore_interrupts(irq);
 }
 
 
@@ -128,59 +170,93 @@ uint32_t event_is_signaled(event_t* event)
 //
 uint32_t event_wait(event_t* event, sys_time_t timeout)
 {
+	// Test the event and start waiting without being interrupted
+	uint32_t irq = _save_and_disable_interrupts();
+	uint32_t result = 1;
+
 	if (event->count == 0)
 	{
-		// No timeout and no count, fail immediately
-		if (timeout == 0)
-			return 0;
+		// Wait in line, return the wait result. Fails 
+		// immediately when the timeout is zero.
+		result = thread_queue_wait(&event->waiters, THREAD_STATE_EVENT_WAIT, event, timeout);
+	}
+	else if (event->type == EVENT_TYPE_AUTO)
+	{
+		// Decrement event counter for auto event
+		event->count--;
+	}
 
-		// Add a wait
-		event->waits++;
+	_restore_interrupts(irq);
+	return result;
+}
 
-		// Yield to scheduler, return its wait result
-		return thread_wait_event(event, timeout);
-	}
-	else
+
+
+//
+// Wait for an event from a task
+//
+uint32_t event_wait_task(event_t* event, task_t* task, sys_time_t timeout)
+{
+	uint32_t irq = _save_and_disable_interrupts();
+	uint32_t result = 1;
+
+	if (event->count != 0)
 	{
 		// Decrement event counter for auto event
 		if (event->type == EVENT_TYPE_AUTO)
-		{
-			ASSERT(event->count != 0);
 			event->count--;
-		}
-
-		return 1;
+		task->result = 1;
+	}
+	else if (timeout == TIMEOUT_IMMEDIATE)
+	{
+		// Fail immediately
+		task->result = 0;
 	}
+	else
+	{
+		// Wait in line, the task is resumed with the wait result
+		task_queue_wait(&event->tasks, task, timeout);
+		result = 0;
+	}
+
+	_restore_interrupts(irq);
+	return result;
 }
 
 
 
 //
-// Used by thread scheduler: check whether an event is signaled
-// If the event is signaled and auto reset, reset the event here
+// Wait operations of events
 //
-uint32_t event_acquire_scheduler(event_t* event, thread_id_t thread_id)
+static uint32_t event_wait_is_ready(void* object)
 {
-	// This should only ever be called by the scheduler
-	ASSERT(thread_get_id() == THREAD_SCHEDULER_THREAD_ID);
+	return ((event_t*)object)->count != 0;
+}
+
 
-	// If the thread isn't signaled, fail
+
+static uint32_t event_wait_acquire(void* object)
+{
+	event_t* event = (event_t*)object;
 	if (event->count == 0)
 		return 0;
-
-	// If the event is auto reset, update the count
 	if (event->type == EVENT_TYPE_AUTO)
-	{
-		ASSERT(event->count != 0);
 		event->count--;
-	}
-	else
-	{
-		TRACE("Event type: %u, name: %s, count: %u, waits: %u", event->type, event->name, event->count, event->waits);
-		ASSERT(false);
-	}
-
-	// Event acquired
-	event->waits--;
 	return 1;
 }
+
+
+
+static thread_wait_list_t* event_wait_list(void* object)
+{
+	return &((event_t*)object)->wait_list;
+}
+
+
+
+const thread_wait_ops_t event_wait_ops = 
+{
+	&event_wait_is_ready,
+	&event_wait_acquire,
+	&event_wait_list
+};
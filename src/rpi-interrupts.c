@@ -20,6 +20,8 @@
 #include "rpi-armtimer.h"
 #include "rpi-led.h"
 #include "rpi-systimer.h"
+#include "rpi-thread.h"
+#include "rpi-smp.h"
 #include "asm-functions.h"
 
 
@@ -71,7 +73,7 @@ void disable_interrupts(void)
 void register_irq_handler(uint8_t irq, irq_handler_t handler)
 {
 	// Disable interrupts
-	_disable_interrupts();
+	uint32_t irq_state = _save_and_disable_interrupts();
 
 	// Check that the irq doesn't have a registered handler yet
 	if (irq_handlers[irq] != NULL)
@@ -88,8 +90,8 @@ void register_irq_handler(uint8_t irq, irq_handler_t handler)
 	else
 		led_error_pulse(3);
 
-	// Re-enable interrupts
-	_enable_interrupts();
+	// Restore interrupts
+	_restore_interrupts(irq_state);
 }
 
 
@@ -144,10 +146,17 @@ void INTERRUPT(ABORT) reset_vector(void)
     @brief The undefined instruction interrupt handler
 
     If an undefined instruction is encountered, the CPU will start
-    executing this function. Just trap here as a debug solution.
+    executing this function. It is called from _undefined_entry, which
+    retries the instruction when this function returns. VFP instructions
+    trap here while VFP is disabled for the current thread; anything
+    else is trapped here as a debug solution.
 */
-void INTERRUPT(UNDEF) undefined_instruction_vector(void)
+void undefined_instruction_vector(void)
 {
+	// Give the current thread its VFP state
+	if (thread_vfp_trap())
+		return;
+
     while( 1 )
     {
 		led_error_pulse(4);
@@ -203,9 +212,27 @@ void INTERRUPT(ABORT) data_abort_vector(void)
     up to the handler to determine the source of the interrupt and most
     importantly clear the interrupt flag so that the interrupt won't
     immediately put us back into the start of the handler again.
+
+    It is called from _interrupt_entry, which has already saved the
+    interrupted context on the supervisor stack, so it is an ordinary
+    function rather than an INTERRUPT(IRQ) one. Once all sources are
+    handled, the scheduler gets the chance to preempt the interrupted
+    thread. On multi-core builds, _interrupt_entry holds the kernel lock
+    while this function runs.
 */
-void INTERRUPT(IRQ) interrupt_vector(void)
+void interrupt_vector(void)
 {
+#if defined( RPI2 )
+	// Acknowledge inter-processor interrupts, they only make the core reschedule.
+	// The peripheral interrupts are routed to the boot core.
+	smp_interrupt();
+	if (_get_core_id() != 0)
+	{
+		thread_preempt();
+		return;
+	}
+#endif
+
 	while (rpi_irq_controller->irq_basic_pending | rpi_irq_controller->irq_pending_1 | rpi_irq_controller->irq_pending_2)
 	{
 		// Timer interrupt
@@ -233,6 +260,9 @@ void INTERRUPT(IRQ) interrupt_vector(void)
 					irq_handlers[i + 32]();
 				}
 	}
+
+	// Switch threads if the handlers made that necessary
+	thread_preempt();
 }
 
 
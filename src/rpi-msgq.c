@@ -0,0 +1,243 @@
+/*
+	Licensed to the Apache Software Foundation (ASF) under one
+	or more contributor license agreements.  See the NOTICE file
+	distributed with this work for additional information
+	regarding copyright ownership.  The ASF licenses this file
+	to you under the Apache License, Version 2.0 (the
+	"License"); you may not use this file except in compliance
+	with the License.  You may obtain a copy of the License at
+
+	http://www.apache.org/licenses/LICENSE-2.0
+
+	Unless required by applicable law or agreed to in writing,
+	software distributed under the License is distributed on an
+	"AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+	KIND, either express or implied.  See the License for the
+	specific language governing permissions and limitations
+	under the License.
+*/
+#include "rpi-msgq.h"
+#include "rpi-thread.h"
+#include "asm-functions.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <malloc.h>
+#include <stdio.h>
+
+
+
+//
+// Message queue structure
+//
+struct msgq_t
+{
+	void**			msgs;					// Ring of queued messages
+	uint32_t		capacity;				// Size of the ring
+	uint32_t		head;					// Index of the oldest message
+	uint32_t		count;					// Number of queued messages
+	thread_queue_t	receivers;				// Threads waiting for a message, in arrival order
+	thread_queue_t	senders;				// Threads waiting for free space, in arrival order
+	thread_wait_list_t wait_list;			// Threads waiting for a message among other objects
+	char			name[MSGQ_NAME_LEN];	// Queue name
+};
+
+
+
+//
+// Get the time remaining until a deadline
+//
+static inline sys_time_t msgq_remaining(sys_time_t deadline)
+{
+	if (deadline == TIMEOUT_INFINITE)
+		return TIMEOUT_INFINITE;
+
+	sys_time_t time = sys_timer_get_time();
+	return deadline > time ? deadline - time : 0;
+}
+
+
+
+//
+// Create a message queue
+//
+msgq_t* msgq_create(const char* name, uint32_t capacity)
+{
+	ASSERT(capacity != 0);
+
+	// Create and initialize queue
+	msgq_t* msgq = (msgq_t*)malloc(sizeof(msgq_t));
+	memset(msgq, 0, sizeof(msgq_t));
+	msgq->msgs = (void**)malloc(capacity * sizeof(void*));
+	ASSERT(msgq->msgs != NULL);
+	msgq->capacity = capacity;
+
+	// Copy queue name
+	strncpy(msgq->name, name, MSGQ_NAME_LEN);
+	msgq->name[MSGQ_NAME_LEN - 1] = '\x0';
+
+	return msgq;
+}
+
+
+
+//
+// Destroy a message queue
+//
+void msgq_destroy(msgq_t* msgq)
+{
+	ASSERT(msgq->receivers.head == NULL && msgq->senders.head == NULL);
+	ASSERT(msgq->wait_list.head == NULL);
+	free(msgq->msgs);
+	free(msgq);
+}
+
+
+
+//
+// Get message queue name
+//
+const char* msgq_get_name(msgq_t* msgq)
+{
+	return msgq->name;
+}
+
+
+
+//
+// Send a message
+//
+uint32_t msgq_send(msgq_t* msgq, void* msg, sys_time_t timeout)
+{
+	sys_time_t deadline = TIMEOUT_INFINITE;
+	if (timeout != TIMEOUT_INFINITE)
+		deadline = sys_timer_get_time() + timeout;
+
+	// Messages may be sent from interrupt handlers
+	uint32_t irq = _save_and_disable_interrupts();
+
+	// Wait for free space. A woken sender may find the space taken again by
+	// another sender, so test again after every wakeup.
+	while (msgq->count == msgq->capacity)
+	{
+		sys_time_t remaining = msgq_remaining(deadline);
+		if (remaining == 0 || 
+			(!thread_queue_wait(&msgq->senders, THREAD_STATE_MSGQ_WAIT, msgq, remaining) && msgq->count == msgq->capacity))
+		{
+			_restore_interrupts(irq);
+			return 0;
+		}
+	}
+
+	// Append the message and wake the longest waiting receiver, and the threads 
+	// that wait for the queue among other objects
+	uint32_t index = msgq->head + msgq->count;
+	if (index >= msgq->capacity)
+		index -= msgq->capacity;
+	msgq->msgs[index] = msg;
+	msgq->count++;
+	thread_queue_wake_one(&msgq->receivers, 1);
+	thread_wait_notify(&msgq->wait_list);
+
+	_restore_interrupts(irq);
+	return 1;
+}
+
+
+
+//
+// Receive a message
+//
+uint32_t msgq_receive(msgq_t* msgq, void** msg, sys_time_t timeout)
+{
+	return msgq_receive_batch(msgq, msg, 1, timeout);
+}
+
+
+
+//
+// Receive a batch of messages
+//
+uint32_t msgq_receive_batch(msgq_t* msgq, void** msgs, uint32_t max_count, sys_time_t timeout)
+{
+	ASSERT(max_count != 0);
+
+	sys_time_t deadline = TIMEOUT_INFINITE;
+	if (timeout != TIMEOUT_INFINITE)
+		deadline = sys_timer_get_time() + timeout;
+
+	uint32_t irq = _save_and_disable_interrupts();
+
+	// Wait for a message. A woken receiver may find the messages taken by
+	// another receiver, so test again after every wakeup.
+	while (msgq->count == 0)
+	{
+		sys_time_t remaining = msgq_remaining(deadline);
+		if (remaining == 0 ||
+			(!thread_queue_wait(&msgq->receivers, THREAD_STATE_MSGQ_WAIT, msgq, remaining) && msgq->count == 0))
+		{
+			_restore_interrupts(irq);
+			return 0;
+		}
+	}
+
+	// Take as many messages as are queued, up to the maximum
+	uint32_t count = msgq->count < max_count ? msgq->count : max_count;
+	for (uint32_t i = 0; i < count; i++)
+	{
+		msgs[i] = msgq->msgs[msgq->head];
+		if (++msgq->head == msgq->capacity)
+			msgq->head = 0;
+	}
+	msgq->count -= count;
+
+	// Wake a waiting sender for every slot that was freed
+	for (uint32_t i = 0; i < count; i++)
+	{
+		if (thread_queue_wake_one(&msgq->senders, 1) == THREAD_INVALID_ID)
+			break;
+	}
+
+	_restore_interrupts(irq);
+	return count;
+}
+
+
+
+//
+// Get the number of queued messages
+//
+uint32_t msgq_get_count(msgq_t* msgq)
+{
+	return msgq->count;
+}
+
+
+
+//
+// Wait operations of message queues
+//
+static uint32_t msgq_wait_is_ready(void* object)
+{
+	return ((msgq_t*)object)->count != 0;
+}
+
+
+
+static thread_wait_list_t* msgq_wait_list(void* object)
+{
+	return &((msgq_t*)object)->wait_list;
+}
+
+
+
+//
+// A message can't be acquired without a receive buffer, so message queues are only
+// tested
+//
+const thread_wait_ops_t msgq_wait_ops = 
+{
+	&msgq_wait_is_ready,
+	NULL,
+	&msgq_wait_list
+};
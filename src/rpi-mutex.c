@@ -18,6 +18,8 @@
 */
 #include "rpi-mutex.h"
 #include "rpi-thread.h"
+#include "rpi-task.h"
+#include "asm-functions.h"
 
 #include <stdlib.h>
 #include <string.h>
@@ -32,8 +34,11 @@
 struct mutex_t
 {
 	thread_id_t		owner;					// Owning thread
+	task_t*			owner_task;				// Owning task, if locked by a task on the owning thread
 	uint32_t		count;					// Owning thread recursive lock count
-	uint32_t		waits;					// Number of threads waiting for the mutex
+	thread_queue_t	waiters;				// Threads waiting for the mutex, in arrival order
+	task_queue_t	tasks;					// Tasks waiting for the mutex, in arrival order
+	thread_wait_list_t wait_list;			// Threads waiting for the mutex among other objects
 	char			name[MUTEX_NAME_LEN];	// Mutex name
 };
 
@@ -64,7 +69,9 @@ void mutex_destroy(mutex_t* mutex)
 {
 	ASSERT(mutex->owner == 0);
 	ASSERT(mutex->count == 0);
-	ASSERT(mutex->waits == 0);
+	ASSERT(mutex->waiters.head == NULL);
+	ASSERT(mutex->tasks.head == NULL);
+	ASSERT(mutex->wait_list.head == NULL);
 
 	free(mutex);
 }
@@ -82,12 +89,16 @@ const char* mutex_get_name(mutex_t* mutex)
 
 
 //
-// Try to acquire a mutex. Implementation of trylock.
+// Lock a mutex
 //
-static uint32_t mutex_trylock(mutex_t* mutex, thread_id_t thread_id)
+uint32_t mutex_lock(mutex_t* mutex, sys_time_t timeout)
 {
+	thread_id_t thread_id = thread_get_id();
 	ASSERT(thread_id != THREAD_INVALID_ID);
-	ASSERT(mutex->waits > 0);
+
+	// Test the mutex and start waiting without being preempted
+	uint32_t irq = _save_and_disable_interrupts();
+	uint32_t result = 1;
 
 	if (mutex->owner == 0)
 	{
@@ -95,53 +106,57 @@ static uint32_t mutex_trylock(mutex_t* mutex, thread_id_t thread_id)
 
 		// The thread is now owner of the mutex
 		mutex->owner = thread_id;
-
-		// Update counters
-		mutex->count++;
-		mutex->waits--;
-
-		// Mutex locked successfully
-		return 1;
+		mutex->count = 1;
 	}
 	else if (mutex->owner == thread_id)
 	{
 		ASSERT(mutex->count > 0);
 
-		// Update counters
-		mutex->count++;
-		mutex->waits--;
+		// A task on this thread holds the mutex, waiting would block the task runner
+		ASSERT(mutex->owner_task == NULL);
 
-		// Mutex locked successfully
-		return 1;
+		// Recursive lock
+		mutex->count++;
 	}
 	else
 	{
 		// Failed waits on the scheduler thread are a problem
 		ASSERT(thread_id != THREAD_SCHEDULER_THREAD_ID);
-		return 0;
+
+		// Wait in line, or return immediately when the timeout is zero. When 
+		// the wait succeeds, the unlocking thread has already made this 
+		// thread the owner.
+		result = thread_queue_wait(&mutex->waiters, THREAD_STATE_MUTEX_WAIT, mutex, timeout);
 	}
+
+	_restore_interrupts(irq);
+	return result;
 }
 
 
 
 //
-// Lock a mutex
+// Hand a released mutex over to the longest waiting thread, or else to the longest 
+// waiting task, if any. Otherwise, threads that wait for the mutex among other 
+// objects may take it. Called with interrupts disabled.
 //
-uint32_t mutex_lock(mutex_t* mutex, sys_time_t timeout)
+static void mutex_hand_off(mutex_t* mutex)
 {
-	// Add to wait count
-	mutex->waits++;
-
-	// Try to lock the mutex directly
-	if (mutex_trylock(mutex, thread_get_id()))
-		return 1;
-
-	// If the timeout is zero, return immediately
-	if (timeout == 0)
-		return 0;
-
-	// Yield the thread, return its result
-	return thread_wait_mutex(mutex, timeout);
+	mutex->owner_task = NULL;
+	mutex->owner = thread_queue_wake_one(&mutex->waiters, 1);
+	if (mutex->owner != THREAD_INVALID_ID)
+	{
+		mutex->count = 1;
+	}
+	else if ((mutex->owner_task = task_queue_wake_one(&mutex->tasks, 1)) != NULL)
+	{
+		mutex->owner = task_get_thread_id(mutex->owner_task);
+		mutex->count = 1;
+	}
+	else
+	{
+		thread_wait_notify(&mutex->wait_list);
+	}
 }
 
 
@@ -154,21 +169,150 @@ void mutex_unlock(mutex_t* mutex)
 	ASSERT(mutex->count > 0);
 	ASSERT(mutex->owner == thread_get_id());
 
-	// Update count
+	uint32_t irq = _save_and_disable_interrupts();
+
+	// Update count, hand the mutex over when it is released
 	if (--mutex->count == 0)
-		mutex->owner = 0;
+		mutex_hand_off(mutex);
+
+	_restore_interrupts(irq);
+}
+
+
+
+//
+// Release a mutex that the current thread holds, however often it locked it
+//
+uint32_t mutex_release(mutex_t* mutex)
+{
+	ASSERT(mutex->count > 0);
+	ASSERT(mutex->owner == thread_get_id() && mutex->owner_task == NULL);
+
+	uint32_t irq = _save_and_disable_interrupts();
+
+	uint32_t count = mutex->count;
+	mutex->count = 0;
+	mutex_hand_off(mutex);
+
+	_restore_interrupts(irq);
+	return count;
+}
+
+
+
+//
+// Reacquire a mutex released by mutex_release
+//
+void mutex_reacquire(mutex_t* mutex, uint32_t count)
+{
+	// Threads requeued by mutex_requeue own the mutex when they are woken
+	uint32_t irq = _save_and_disable_interrupts();
+	if (mutex->owner != thread_get_id())
+		mutex_lock(mutex, TIMEOUT_INFINITE);
+	mutex->count = count;
+	_restore_interrupts(irq);
+}
+
+
+
+//
+// Move threads from a wait queue to the wait queue of a mutex
+//
+uint32_t mutex_requeue(mutex_t* mutex, thread_queue_t* queue, uint32_t count)
+{
+	uint32_t irq = _save_and_disable_interrupts();
+
+	// Queue the threads behind the threads that already wait for the mutex, and 
+	// give the mutex to the first of them if it is free
+	count = thread_queue_requeue(queue, &mutex->waiters, count, THREAD_STATE_MUTEX_WAIT, mutex);
+	if (count != 0 && mutex->owner == THREAD_INVALID_ID)
+		mutex_hand_off(mutex);
+
+	_restore_interrupts(irq);
+	return count;
+}
+
+
+
+//
+// Lock a mutex from a task
+//
+uint32_t mutex_lock_task(mutex_t* mutex, task_t* task, sys_time_t timeout)
+{
+	uint32_t irq = _save_and_disable_interrupts();
+	uint32_t result = 1;
+
+	if (mutex->owner == 0)
+	{
+		ASSERT(mutex->count == 0);
+
+		// The task is now owner of the mutex
+		mutex->owner = task_get_thread_id(task);
+		mutex->owner_task = task;
+		mutex->count = 1;
+		task->result = 1;
+	}
+	else if (mutex->owner_task == task)
+	{
+		ASSERT(mutex->count > 0);
+
+		// Recursive lock
+		mutex->count++;
+		task->result = 1;
+	}
+	else if (timeout == TIMEOUT_IMMEDIATE)
+	{
+		// Fail immediately
+		task->result = 0;
+	}
+	else
+	{
+		// Wait in line. When the wait succeeds, the unlocking thread 
+		// has already made this task the owner.
+		task_queue_wait(&mutex->tasks, task, timeout);
+		result = 0;
+	}
+
+	_restore_interrupts(irq);
+	return result;
 }
 
 
 
 //
-// Try to acquire a mutex. Used by the thread scheduler.
+// Wait operations of mutexes. The current thread can acquire a mutex that is free, 
+// or that it holds itself outside a task.
 //
-uint32_t mutex_acquire_scheduler(mutex_t* mutex, thread_id_t thread_id)
+static uint32_t mutex_wait_is_ready(void* object)
 {
-	// This should only ever be called by the scheduler
-	ASSERT(thread_get_id() == THREAD_SCHEDULER_THREAD_ID);
+	mutex_t* mutex = (mutex_t*)object;
+	return mutex->owner == 0 || (mutex->owner == thread_get_id() && mutex->owner_task == NULL);
+}
 
-	// Try to lock the mutex
-	return mutex_trylock(mutex, thread_id);
+
+
+static uint32_t mutex_wait_acquire(void* object)
+{
+	mutex_t* mutex = (mutex_t*)object;
+	if (!mutex_wait_is_ready(mutex))
+		return 0;
+	mutex->owner = thread_get_id();
+	mutex->count++;
+	return 1;
+}
+
+
+
+static thread_wait_list_t* mutex_wait_list(void* object)
+{
+	return &((mutex_t*)object)->wait_list;
 }
+
+
+
+const thread_wait_ops_t mutex_wait_ops = 
+{
+	&mutex_wait_is_ready,
+	&mutex_wait_acquire,
+	&mutex_wait_list
+};
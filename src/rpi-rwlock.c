@@ -0,0 +1,199 @@
+/*
+	Licensed to the Apache Software Foundation (ASF) under one
+	or more contributor license agreements.  See the NOTICE file
+	distributed with this work for additional information
+	regarding copyright ownership.  The ASF licenses this file
+	to you under the Apache License, Version 2.0 (the
+	"License"); you may not use this file except in compliance
+	with the License.  You may obtain a copy of the License at
+
+	http://www.apache.org/licenses/LICENSE-2.0
+
+	Unless required by applicable law or agreed to in writing,
+	software distributed under the License is distributed on an
+	"AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+	KIND, either express or implied.  See the License for the
+	specific language governing permissions and limitations
+	under the License.
+*/
+#include "rpi-rwlock.h"
+#include "rpi-thread.h"
+#include "asm-functions.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <malloc.h>
+#include <stdio.h>
+
+
+
+//
+// Reader-writer lock structure
+//
+struct rwlock_t
+{
+	uint32_t		flags;					// RWLOCK_* flags
+	uint32_t		readers;				// Number of shared holders
+	thread_id_t		writer;					// Exclusive holder
+	thread_queue_t	read_waiters;			// Threads waiting for shared access, in arrival order
+	thread_queue_t	write_waiters;			// Threads waiting for exclusive access, in arrival order
+	char			name[RWLOCK_NAME_LEN];	// Lock name
+};
+
+
+
+//
+// Hand a free lock over to the waiters: the longest waiting writer, or all waiting
+// readers at once. Waiting readers go first unless writers are preferred. Woken 
+// threads already hold the lock. Called with interrupts disabled.
+//
+static void rwlock_hand_off(rwlock_t* rwlock)
+{
+	ASSERT(rwlock->writer == THREAD_INVALID_ID && rwlock->readers == 0);
+
+	if (rwlock->write_waiters.head != NULL && 
+		((rwlock->flags & RWLOCK_WRITER_PREFERENCE) || rwlock->read_waiters.head == NULL))
+	{
+		rwlock->writer = thread_queue_wake_one(&rwlock->write_waiters, 1);
+	}
+	else
+	{
+		rwlock->readers = thread_queue_wake_all(&rwlock->read_waiters, 1);
+	}
+}
+
+
+
+//
+// Create a reader-writer lock
+//
+rwlock_t* rwlock_create(const char* name, uint32_t flags)
+{
+	// Create and initialize lock
+	rwlock_t* rwlock = (rwlock_t*)malloc(sizeof(rwlock_t));
+	memset(rwlock, 0, sizeof(rwlock_t));
+	rwlock->flags = flags;
+
+	// Copy lock name
+	strncpy(rwlock->name, name, RWLOCK_NAME_LEN);
+	rwlock->name[RWLOCK_NAME_LEN - 1] = '\x0';
+
+	return rwlock;
+}
+
+
+
+//
+// Destroy a reader-writer lock
+//
+void rwlock_destroy(rwlock_t* rwlock)
+{
+	ASSERT(rwlock->readers == 0 && rwlock->writer == THREAD_INVALID_ID);
+	ASSERT(rwlock->read_waiters.head == NULL && rwlock->write_waiters.head == NULL);
+	free(rwlock);
+}
+
+
+
+//
+// Get reader-writer lock name
+//
+const char* rwlock_get_name(rwlock_t* rwlock)
+{
+	return rwlock->name;
+}
+
+
+
+//
+// Acquire a reader-writer lock shared
+//
+uint32_t rwlock_read_lock(rwlock_t* rwlock, sys_time_t timeout)
+{
+	// Test the lock and start waiting without being interrupted
+	uint32_t irq = _save_and_disable_interrupts();
+	uint32_t result = 1;
+
+	// Join the readers unless a writer holds the lock, or waits for it and is preferred
+	if (rwlock->writer == THREAD_INVALID_ID &&
+		(!(rwlock->flags & RWLOCK_WRITER_PREFERENCE) || rwlock->write_waiters.head == NULL))
+	{
+		rwlock->readers++;
+	}
+	else
+	{
+		// Wait in line, or return immediately when the timeout is zero. When
+		// the wait succeeds, the releasing thread has counted this reader.
+		ASSERT(rwlock->writer != thread_get_id());
+		result = thread_queue_wait(&rwlock->read_waiters, THREAD_STATE_RWLOCK_WAIT, rwlock, timeout);
+	}
+
+	_restore_interrupts(irq);
+	return result;
+}
+
+
+
+//
+// Release a shared acquisition
+//
+void rwlock_read_unlock(rwlock_t* rwlock)
+{
+	uint32_t irq = _save_and_disable_interrupts();
+
+	ASSERT(rwlock->readers > 0);
+	if (--rwlock->readers == 0)
+		rwlock_hand_off(rwlock);
+
+	_restore_interrupts(irq);
+}
+
+
+
+//
+// Acquire a reader-writer lock exclusively
+//
+uint32_t rwlock_write_lock(rwlock_t* rwlock, sys_time_t timeout)
+{
+	thread_id_t thread_id = thread_get_id();
+
+	// Test the lock and start waiting without being interrupted
+	uint32_t irq = _save_and_disable_interrupts();
+	uint32_t result = 1;
+
+	if (rwlock->writer == THREAD_INVALID_ID && rwlock->readers == 0)
+	{
+		rwlock->writer = thread_id;
+	}
+	else
+	{
+		// Wait in line, or return immediately when the timeout is zero. When
+		// the wait succeeds, the releasing thread has made this thread the writer.
+		ASSERT(rwlock->writer != thread_id);
+		result = thread_queue_wait(&rwlock->write_waiters, THREAD_STATE_RWLOCK_WAIT, rwlock, timeout);
+
+		// Readers that queued behind this writer can share the lock now if
+		// they were only held back by writer preference
+		if (result == 0 && rwlock->writer == THREAD_INVALID_ID && rwlock->write_waiters.head == NULL)
+			rwlock->readers += thread_queue_wake_all(&rwlock->read_waiters, 1);
+	}
+
+	_restore_interrupts(irq);
+	return result;
+}
+
+
+
+//
+// Release an exclusive acquisition
+//
+void rwlock_write_unlock(rwlock_t* rwlock)
+{
+	uint32_t irq = _save_and_disable_interrupts();
+
+	ASSERT(rwlock->writer == thread_get_id());
+	rwlock->writer = THREAD_INVALID_ID;
+	rwlock_hand_off(rwlock);
+
+	_restore_interrupts(irq);
+}
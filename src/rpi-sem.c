@@ -0,0 +1,213 @@
+/*
+	Licensed to the Apache Software Foundation (ASF) under one
+	or more contributor license agreements.  See the NOTICE file
+	distributed with this work for additional information
+	regarding copyright ownership.  The ASF licenses this file
+	to you under the Apache License, Version 2.0 (the
+	"License"); you may not use this file except in compliance
+	with the License.  You may obtain a copy of the License at
+
+	http://www.apache.org/licenses/LICENSE-2.0
+
+	Unless required by applicable law or agreed to in writing,
+	software distributed under the License is distributed on an
+	"AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+	KIND, either express or implied.  See the License for the
+	specific language governing permissions and limitations
+	under the License.
+*/
+#include "rpi-sem.h"
+#include "rpi-thread.h"
+#include "asm-functions.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <malloc.h>
+#include <stdio.h>
+
+
+
+//
+// Semaphore structure
+//
+// The count is only non-zero while no thread waits, since a post hands the unit 
+// directly to a waiter. It is changed with atomic operations so sem_trywait does
+// not need the kernel lock; blocking waits and posts also hold the lock, so the
+// count and the wait queue change together.
+//
+struct sem_t
+{
+	volatile uint32_t	count;					// Available units
+	uint32_t			maximum;				// Maximum count
+	thread_queue_t		waiters;				// Threads waiting for a unit, in arrival order
+	thread_wait_list_t	wait_list;				// Threads waiting for a unit among other objects
+	char				name[SEM_NAME_LEN];		// Semaphore name
+};
+
+
+
+//
+// Create a semaphore
+//
+sem_t* sem_create(const char* name, uint32_t initial_count, uint32_t maximum_count)
+{
+	ASSERT(maximum_count != 0 && initial_count <= maximum_count);
+
+	// Create and initialize semaphore
+	sem_t* sem = (sem_t*)malloc(sizeof(sem_t));
+	memset(sem, 0, sizeof(sem_t));
+	sem->count = initial_count;
+	sem->maximum = maximum_count;
+
+	// Copy semaphore name
+	strncpy(sem->name, name, SEM_NAME_LEN);
+	sem->name[SEM_NAME_LEN - 1] = '\x0';
+
+	return sem;
+}
+
+
+
+//
+// Destroy a semaphore
+//
+void sem_destroy(sem_t* sem)
+{
+	ASSERT(sem->waiters.head == NULL);
+	ASSERT(sem->wait_list.head == NULL);
+	free(sem);
+}
+
+
+
+//
+// Get semaphore name
+//
+const char* sem_get_name(sem_t* sem)
+{
+	return sem->name;
+}
+
+
+
+//
+// Post a semaphore
+//
+uint32_t sem_post(sem_t* sem)
+{
+	// Semaphores may be posted from interrupt handlers
+	uint32_t irq = _save_and_disable_interrupts();
+
+	// Hand the unit directly to the longest waiting thread
+	if (thread_queue_wake_one(&sem->waiters, 1) != THREAD_INVALID_ID)
+	{
+		_restore_interrupts(irq);
+		return 1;
+	}
+
+	// Keep the unit, unless the count is at its maximum. The count can be
+	// decremented concurrently by sem_trywait.
+	uint32_t count = sem->count;
+	do
+	{
+		if (count == sem->maximum)
+		{
+			_restore_interrupts(irq);
+			return 0;
+		}
+	} 
+	while (!__atomic_compare_exchange_n(&sem->count, &count, count + 1, 0, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+	// Let threads that wait for multiple objects take the unit
+	thread_wait_notify(&sem->wait_list);
+
+	_restore_interrupts(irq);
+	return 1;
+}
+
+
+
+//
+// Wait for a semaphore
+//
+uint32_t sem_wait(sem_t* sem, sys_time_t timeout)
+{
+	// Take a unit without the kernel lock if one is available
+	if (sem_trywait(sem))
+		return 1;
+
+	// Test the count again and start waiting without being interrupted
+	uint32_t irq = _save_and_disable_interrupts();
+	uint32_t result = 1;
+
+	if (!sem_trywait(sem))
+	{
+		// Wait in line, or return immediately when the timeout is zero. When
+		// the wait succeeds, the posting thread has handed over its unit.
+		result = thread_queue_wait(&sem->waiters, THREAD_STATE_SEM_WAIT, sem, timeout);
+	}
+
+	_restore_interrupts(irq);
+	return result;
+}
+
+
+
+//
+// Try to decrement the count of a semaphore
+//
+uint32_t sem_trywait(sem_t* sem)
+{
+	uint32_t count = sem->count;
+	do
+	{
+		if (count == 0)
+			return 0;
+	} 
+	while (!__atomic_compare_exchange_n(&sem->count, &count, count - 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED));
+
+	return 1;
+}
+
+
+
+//
+// Get the current count of a semaphore
+//
+uint32_t sem_get_count(sem_t* sem)
+{
+	return sem->count;
+}
+
+
+
+//
+// Wait operations of semaphores
+//
+static uint32_t sem_wait_is_ready(void* object)
+{
+	return ((sem_t*)object)->count != 0;
+}
+
+
+
+static uint32_t sem_wait_acquire(void* object)
+{
+	return sem_trywait((sem_t*)object);
+}
+
+
+
+static thread_wait_list_t* sem_wait_list(void* object)
+{
+	return &((sem_t*)object)->wait_list;
+}
+
+
+
+const thread_wait_ops_t sem_wait_ops = 
+{
+	&sem_wait_is_ready,
+	&sem_wait_acquire,
+	&sem_wait_list
+};
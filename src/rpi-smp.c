@@ -0,0 +1,129 @@
+/*
+	Licensed to the Apache Software Foundation (ASF) under one
+	or more contributor license agreements.  See the NOTICE file
+	distributed with this work for additional information
+	regarding copyright ownership.  The ASF licenses this file
+	to you under the Apache License, Version 2.0 (the
+	"License"); you may not use this file except in compliance
+	with the License.  You may obtain a copy of the License at
+
+	http://www.apache.org/licenses/LICENSE-2.0
+
+	Unless required by applicable law or agreed to in writing,
+	software distributed under the License is distributed on an
+	"AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+	KIND, either express or implied.  See the License for the
+	specific language governing permissions and limitations
+	under the License.
+*/
+#include "rpi-smp.h"
+#include "rpi-thread.h"
+#include "asm-functions.h"
+
+#if defined( RPI2 )
+
+
+
+//
+// Section descriptors of the translation table
+//
+#define SECTION_NORMAL			0x11C0E		// Shareable, write-back write-allocate, full access
+#define SECTION_DEVICE			0x00C16		// Shareable device, full access, execute never
+
+
+
+//
+// Inter-processor interrupts are sent through mailbox 0 of the target core, 
+// secondary cores are started through mailbox 3
+//
+#define SMP_IPI_MAILBOX			0
+#define SMP_START_MAILBOX		3
+
+
+
+//
+// Translation table of all cores, maps every 1 MB section to itself. Memory below 
+// the peripherals is normal memory, the peripherals and local peripherals are 
+// device memory.
+//
+static uint32_t translation_table[4096] __attribute__((aligned(0x4000)));
+
+
+
+//
+// Entry point of the secondary cores, in start.s
+//
+extern void _secondary_start(void);
+
+
+
+//
+// Enable the MMU and caches on the boot core
+//
+void smp_init(void)
+{
+	// Build the translation table
+	for (uint32_t i = 0; i < 4096; i++)
+		translation_table[i] = (i << 20) | ((i << 20) < PERIPHERAL_BASE ? SECTION_NORMAL : SECTION_DEVICE);
+
+	_mmu_enable(translation_table);
+
+	// Take inter-processor interrupts
+	rpi_local->mailbox_irq_control[0] = (1 << SMP_IPI_MAILBOX);
+}
+
+
+
+//
+// Start the secondary cores
+//
+void smp_start_cores(void)
+{
+	// The firmware waits for an event and then reads the start address from mailbox 3
+	for (uint32_t core = 1; core < RPI_CORE_COUNT; core++)
+		rpi_local->mailbox_set[core][SMP_START_MAILBOX] = (uint32_t)&_secondary_start;
+	_send_event();
+}
+
+
+
+//
+// Main function of the secondary cores, called from _secondary_start
+//
+void smp_secondary_main(uint32_t core)
+{
+	// Share the translation table and the coherent caches of the boot core
+	_mmu_enable(translation_table);
+
+	// Take inter-processor interrupts
+	rpi_local->mailbox_irq_control[core] = (1 << SMP_IPI_MAILBOX);
+
+	// Run the scheduler of the core. This call will not return.
+	thread_scheduler();
+}
+
+
+
+//
+// Send an inter-processor interrupt to a core
+//
+void smp_send_ipi(uint32_t core)
+{
+	rpi_local->mailbox_set[core][SMP_IPI_MAILBOX] = 1;
+}
+
+
+
+//
+// Acknowledge the inter-processor interrupt of the current core
+//
+void smp_interrupt(void)
+{
+	uint32_t core = _get_core_id();
+	if (rpi_local->irq_source[core] & RPI_LOCAL_IRQ_MAILBOX0)
+		rpi_local->mailbox_clear[core][SMP_IPI_MAILBOX] = 0xFFFFFFFF;
+}
+
+
+
+#endif
@@ -47,9 +47,21 @@ static uint32_t num_timers = 0;
 
 
 //
-// System timer interval
+// Earliest deadline of the installed timers and of the thread scheduler
 //
-static uint32_t sys_timer_interval = 0x1000;
+static sys_time_t timer_deadline = TIMEOUT_INFINITE;
+static sys_time_t thread_deadline = TIMEOUT_INFINITE;
+
+
+
+//
+// Compare channel C1 is programmed at least this many microseconds ahead, so the
+// counter can't pass it while it is written, and at most this many microseconds
+// ahead. The timer interrupt occurs at least every two seconds, so the thread
+// scheduler can extend the 32-bit cycle counter before it wraps.
+//
+#define SYS_TIMER_MIN_DELTA		2
+#define SYS_TIMER_MAX_DELTA		(1u << 21)
 
 
 
@@ -95,6 +107,50 @@ void sys_timer_wait_msec(uint32_t milliseconds)
 
 
 
+//
+// Program compare channel C1 for the earliest deadline. The timer interrupt only
+// occurs when something is due, so an idle CPU stays in WFI until there is work.
+//
+static void sys_timer_set_compare()
+{
+	sys_time_t deadline = timer_deadline < thread_deadline ? timer_deadline : thread_deadline;
+
+	// Determine the distance to the deadline
+	sys_time_t time = sys_timer_get_time();
+	uint32_t delta = SYS_TIMER_MAX_DELTA;
+	if (deadline <= time + SYS_TIMER_MIN_DELTA)
+		delta = SYS_TIMER_MIN_DELTA;
+	else if (deadline - time < SYS_TIMER_MAX_DELTA)
+		delta = (uint32_t)(deadline - time);
+
+	// Set the compare value. If the counter passed it in the meantime, the 
+	// match was missed, so try again a little later.
+	uint32_t compare = (uint32_t)time + delta;
+	rpi_sys_timer->c1 = compare;
+	while ((int32_t)(compare - rpi_sys_timer->clo) <= 0)
+	{
+		compare = rpi_sys_timer->clo + SYS_TIMER_MIN_DELTA;
+		rpi_sys_timer->c1 = compare;
+	}
+}
+
+
+
+//
+// Set the deadline of the thread scheduler
+//
+void sys_timer_set_deadline(sys_time_t deadline)
+{
+	uint32_t irq = _save_and_disable_interrupts();
+
+	thread_deadline = deadline;
+	sys_timer_set_compare();
+
+	_restore_interrupts(irq);
+}
+
+
+
 //
 // Install a timer
 //
@@ -105,10 +161,7 @@ uint32_t sys_timer_install(uint32_t interval, uint32_t count, sys_timer_proc_t c
 		led_error_pulse(2);
 
 	// Ensure we're not interrupted
-	_disable_interrupts();
-
-	// Clear pending interrupts
-	rpi_sys_timer->cs = SYS_TIMER_1;
+	uint32_t irq = _save_and_disable_interrupts();
 
 	// Find a timer slot
 	int timer_id = 0;
@@ -122,12 +175,19 @@ uint32_t sys_timer_install(uint32_t interval, uint32_t count, sys_timer_proc_t c
 			timer->callback = callback;
 			timer->deadline = sys_timer_get_time() + timer->interval;
 			num_timers++;
+
+			// Wake up in time for the timer
+			if (timer->deadline < timer_deadline)
+			{
+				timer_deadline = timer->deadline;
+				sys_timer_set_compare();
+			}
 			break;
 		}
 	}
 
-	// Re-enable interrupts
-	_enable_interrupts();
+	// Restore interrupts
+	_restore_interrupts(irq);
 
 	// Return the timer id
 	return timer_id;
@@ -141,6 +201,7 @@ uint32_t sys_timer_install(uint32_t interval, uint32_t count, sys_timer_proc_t c
 void invoke_timers()
 {
 	// If there's no timers, early out
+	timer_deadline = TIMEOUT_INFINITE;
 	if (num_timers == 0)
 		return;
 
@@ -153,7 +214,7 @@ void invoke_timers()
 		// Check whether the timer is enabled and elapsed
 	if (timers[i].callback != NULL)
 		{
-			if (timers[i].deadline < time)
+			if (timers[i].deadline <= time)
 			{
 				// Determine new deadline before processing the timer
 				timers[i].deadline = sys_timer_get_time() + timers[i].interval;
@@ -171,32 +232,16 @@ void invoke_timers()
 					--num_timers;
 				}
 			}
+
+			// Track the earliest deadline of the remaining timers
+			if (timers[i].callback != NULL && timers[i].deadline < timer_deadline)
+				timer_deadline = timers[i].deadline;
 		}
 	}
 }
 
 
 
-//
-// Set next compare value
-//
-static inline void sys_timer_set_compare()
-{
-	// Initialize previous interrupt time with current time
-	static sys_time_t prev_time = 0;
-	if (prev_time == 0)
-		prev_time = rpi_sys_timer->clo;
-
-	// Set next time as previous time plus interval
-	sys_time_t next_time = prev_time + sys_timer_interval;
-	rpi_sys_timer->c1 = next_time;
-
-	// Store scheduled time as previous time
-	prev_time = next_time;
-}
-
-
-
 //
 // Interrupt called for the system timer
 //
@@ -208,7 +253,7 @@ void sys_timer_interrupt()
 	// Invoke the timers
 	invoke_timers();
 
-	// Set next compare value
+	// Set the compare value for the next deadline
 	sys_timer_set_compare();
 }
 
@@ -219,7 +264,7 @@ void sys_timer_interrupt()
 //
 void sys_timer_enable()
 {
-	TRACE("Enabling system timer at %u us", sys_timer_interval);
+	TRACE("Enabling system timer");
 
 	// Disable interrupts
 	_disable_interrupts();
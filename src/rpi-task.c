@@ -0,0 +1,386 @@
+/*
+	Licensed to the Apache Software Foundation (ASF) under one
+	or more contributor license agreements.  See the NOTICE file
+	distributed with this work for additional information
+	regarding copyright ownership.  The ASF licenses this file
+	to you under the Apache License, Version 2.0 (the
+	"License"); you may not use this file except in compliance
+	with the License.  You may obtain a copy of the License at
+
+	http://www.apache.org/licenses/LICENSE-2.0
+
+	Unless required by applicable law or agreed to in writing,
+	software distributed under the License is distributed on an
+	"AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+	KIND, either express or implied.  See the License for the
+	specific language governing permissions and limitations
+	under the License.
+*/
+#include "rpi-task.h"
+#include "asm-functions.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <malloc.h>
+#include <stdio.h>
+
+
+
+//
+// Task runner structure
+//
+struct task_runner_t
+{
+	thread_id_t		thread_id;		// Runner thread
+	event_t*		wakeup;			// Signaled when a task becomes ready
+	uint32_t		waiting;		// Runner waits on the wakeup event
+	task_queue_t	ready;			// Tasks that are ready to run, in order
+	task_t*			sleep_head;		// Tasks with a timeout, ordered by deadline
+	task_t*			sleep_tail;
+};
+
+
+
+//
+// Append a task to the tail of a queue
+//
+static inline void task_queue_push(task_queue_t* queue, task_t* task)
+{
+	task->next = NULL;
+	task->prev = queue->tail;
+	if (queue->tail != NULL)
+		queue->tail->next = task;
+	else
+		queue->head = task;
+	queue->tail = task;
+}
+
+
+
+//
+// Remove a task from anywhere in the queue that holds it
+//
+static inline void task_queue_remove(task_queue_t* queue, task_t* task)
+{
+	if (task->prev != NULL)
+		task->prev->next = task->next;
+	else
+		queue->head = task->next;
+	if (task->next != NULL)
+		task->next->prev = task->prev;
+	else
+		queue->tail = task->prev;
+	task->next = NULL;
+	task->prev = NULL;
+}
+
+
+
+//
+// Remove the task at the head of a queue, returns NULL if the queue is empty
+//
+static inline task_t* task_queue_pop(task_queue_t* queue)
+{
+	task_t* task = queue->head;
+	if (task != NULL)
+		task_queue_remove(queue, task);
+	return task;
+}
+
+
+
+//
+// Add a task to the timeout list of its runner. Deadlines mostly increase, so the
+// position is searched from the tail.
+//
+static void task_sleep_insert(task_t* task)
+{
+	task_runner_t* runner = task->runner;
+
+	task_t* prev = runner->sleep_tail;
+	while (prev != NULL && prev->deadline > task->deadline)
+		prev = prev->sleep_prev;
+
+	task->sleep_prev = prev;
+	task->sleep_next = prev != NULL ? prev->sleep_next : runner->sleep_head;
+	if (task->sleep_next != NULL)
+		task->sleep_next->sleep_prev = task;
+	else
+		runner->sleep_tail = task;
+	if (prev != NULL)
+		prev->sleep_next = task;
+	else
+		runner->sleep_head = task;
+}
+
+
+
+//
+// Remove a task from the timeout list of its runner
+//
+static void task_sleep_remove(task_t* task)
+{
+	task_runner_t* runner = task->runner;
+
+	if (task->sleep_prev != NULL)
+		task->sleep_prev->sleep_next = task->sleep_next;
+	else
+		runner->sleep_head = task->sleep_next;
+	if (task->sleep_next != NULL)
+		task->sleep_next->sleep_prev = task->sleep_prev;
+	else
+		runner->sleep_tail = task->sleep_prev;
+	task->sleep_next = NULL;
+	task->sleep_prev = NULL;
+	task->deadline = TIMEOUT_INFINITE;
+}
+
+
+
+//
+// Make a task ready with a wait result and wake its runner. Called with interrupts disabled.
+//
+static void task_make_ready(task_t* task, uint32_t result)
+{
+	task_runner_t* runner = task->runner;
+
+	// Cancel the timeout
+	if (task->deadline != TIMEOUT_INFINITE)
+		task_sleep_remove(task);
+
+	task->wait_queue = NULL;
+	task->result = result;
+	task->state = TASK_STATE_READY;
+	task_queue_push(&runner->ready, task);
+
+	// Wake the runner if it is waiting. A running runner finds the task on its 
+	// ready queue, a signal would only leave a count for an empty pass.
+	if (runner->waiting)
+	{
+		runner->waiting = 0;
+		event_signal(runner->wakeup);
+	}
+}
+
+
+
+//
+// Park the running task with a timeout. Called with interrupts disabled.
+//
+static void task_park(task_t* task, sys_time_t timeout)
+{
+	ASSERT(task->state == TASK_STATE_RUNNING);
+	task->state = TASK_STATE_WAITING;
+
+	if (timeout != TIMEOUT_INFINITE)
+	{
+		task->deadline = sys_timer_get_time() + timeout;
+		task_sleep_insert(task);
+	}
+}
+
+
+
+//
+// Resume the tasks whose timeout elapsed. A timed out wait on an object fails,
+// a sleep succeeds. Called with interrupts disabled.
+//
+static void task_wake_expired(task_runner_t* runner, sys_time_t time)
+{
+	while (runner->sleep_head != NULL && runner->sleep_head->deadline <= time)
+	{
+		task_t* task = runner->sleep_head;
+		if (task->wait_queue != NULL)
+		{
+			task_queue_remove(task->wait_queue, task);
+			task_make_ready(task, 0);
+		}
+		else
+		{
+			task_make_ready(task, 1);
+		}
+	}
+}
+
+
+
+//
+// Task runner thread
+//
+static void task_runner_thread(uint32_t thread_arg)
+{
+	task_runner_t* runner = (task_runner_t*)thread_arg;
+
+	while (1)
+	{
+		uint32_t irq = _save_and_disable_interrupts();
+
+		// Resume tasks whose timeout elapsed
+		sys_time_t time = sys_timer_get_time();
+		task_wake_expired(runner, time);
+
+		// Take the next task. If there is none, wait for the earliest timeout.
+		task_t* task = task_queue_pop(&runner->ready);
+		if (task == NULL)
+		{
+			sys_time_t deadline = TIMEOUT_INFINITE;
+			if (runner->sleep_head != NULL)
+				deadline = runner->sleep_head->deadline;
+
+			// Wait with interrupts disabled, so no task is made ready between
+			// the test and the wait
+			runner->waiting = 1;
+			event_wait(runner->wakeup, deadline == TIMEOUT_INFINITE ? TIMEOUT_INFINITE : deadline - time);
+			runner->waiting = 0;
+
+			_restore_interrupts(irq);
+			continue;
+		}
+
+		task->state = TASK_STATE_RUNNING;
+		_restore_interrupts(irq);
+
+		// Run the task until it waits or completes. A waiting task has already
+		// been queued by the wait primitive.
+		if (task->fun(task) == TASK_DONE)
+		{
+			ASSERT(task->state == TASK_STATE_RUNNING);
+			task->state = TASK_STATE_DONE;
+		}
+	}
+}
+
+
+
+//
+// Create a task runner thread
+//
+task_runner_t* task_runner_create(uint32_t stack_size, char const* name, uint32_t priority)
+{
+	// Allocate and clear runner data
+	task_runner_t* runner = (task_runner_t*)malloc(sizeof(task_runner_t));
+	ASSERT(runner != NULL);
+	memset(runner, 0, sizeof(task_runner_t));
+
+	// Create the wakeup event and the thread
+	runner->wakeup = event_create(name, EVENT_TYPE_AUTO);
+	runner->thread_id = thread_create(stack_size, name, &task_runner_thread, (uint32_t)runner);
+	thread_set_priority(runner->thread_id, priority);
+
+	return runner;
+}
+
+
+
+//
+// Start a task on a runner
+//
+void task_start(task_runner_t* runner, task_t* task, task_fun_t fun, void* arg)
+{
+	memset(task, 0, sizeof(task_t));
+	task->fun = fun;
+	task->arg = arg;
+	task->runner = runner;
+	task->deadline = TIMEOUT_INFINITE;
+
+	uint32_t irq = _save_and_disable_interrupts();
+	task_make_ready(task, 1);
+	_restore_interrupts(irq);
+}
+
+
+
+//
+// Check whether a task is done
+//
+uint32_t task_is_done(task_t* task)
+{
+	return task->state == TASK_STATE_DONE;
+}
+
+
+
+//
+// Let the other ready tasks of the runner run first
+//
+uint32_t task_yield(task_t* task)
+{
+	uint32_t irq = _save_and_disable_interrupts();
+
+	task_park(task, TIMEOUT_INFINITE);
+	task_make_ready(task, 1);
+
+	_restore_interrupts(irq);
+	return 0;
+}
+
+
+
+//
+// Resume the task after a number of microseconds
+//
+uint32_t task_sleep(task_t* task, uint32_t microseconds)
+{
+	uint32_t irq = _save_and_disable_interrupts();
+
+	task_park(task, microseconds);
+
+	_restore_interrupts(irq);
+	return 0;
+}
+
+
+
+//
+// Queue a task on the wait queue of an object
+//
+void task_queue_wait(task_queue_t* queue, task_t* task, sys_time_t timeout)
+{
+	task_park(task, timeout);
+	task->wait_queue = queue;
+	task_queue_push(queue, task);
+}
+
+
+
+//
+// Resume the task at the head of a wait queue
+//
+task_t* task_queue_wake_one(task_queue_t* queue, uint32_t result)
+{
+	uint32_t irq = _save_and_disable_interrupts();
+
+	task_t* task = task_queue_pop(queue);
+	if (task != NULL)
+		task_make_ready(task, result);
+
+	_restore_interrupts(irq);
+	return task;
+}
+
+
+
+//
+// Resume all tasks on a wait queue
+//
+uint32_t task_queue_wake_all(task_queue_t* queue, uint32_t result)
+{
+	uint32_t irq = _save_and_disable_interrupts();
+
+	uint32_t count = 0;
+	while (task_queue_wake_one(queue, result) != NULL)
+		count++;
+
+	_restore_interrupts(irq);
+	return count;
+}
+
+
+
+//
+// Get the id of the runner thread of a task
+//
+thread_id_t task_get_thread_id(task_t* task)
+{
+	return task->runner->thread_id;
+}
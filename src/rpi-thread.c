@@ -19,39 +19,43 @@
 #include "rpi-thread.h"
 #include "rpi-systimer.h"
 #include "rpi-uart.h"
+#include "rpi-armtimer.h"
+#include "rpi-smp.h"
+#include "rpi-sem.h"
+#include "rpi-cond.h"
+#include "rpi-rwlock.h"
+#include "rpi-msgq.h"
 #include "asm-functions.h"
 
 #include <stdlib.h>
 #include <string.h>
 #include <malloc.h>
 #include <stdio.h>
+#include <reent.h>
 
 
 
 //
-// Thread states
+// On multi-core builds, _impure_ptr is shared by the cores, so it can't point at
+// the reentrancy data of the thread that each core runs. Newlib must then find it
+// through __getreent, which it only does when built with dynamic reentrancy.
 //
-#define THREAD_STATE_STARTING		0
-#define THREAD_STATE_SCHEDULED		1
-#define THREAD_STATE_RUNNING		2
-#define THREAD_STATE_TIMED_WAIT		3
-#define THREAD_STATE_EVENT_WAIT		4
-#define THREAD_STATE_MUTEX_WAIT		5
-#define THREAD_STATE_SUSPENDED		6
-#define THREAD_STATE_STOPPED		7
+#if defined( RPI2 ) && !defined( __DYNAMIC_REENT__ )
+#error The RPI2 build needs a newlib built with __DYNAMIC_REENT__ defined
+#endif
 
 
 
 //
 // Register struct
 //
+// Threads only switch through a function call, so only the registers that a function
+// must preserve are saved. The value of r0 is loaded when the thread resumes, it 
+// becomes the return value of the function that switched away.
+//
 typedef union
 {
 	struct {
-		uint32_t	r0;
-		uint32_t	r1;
-		uint32_t	r2;
-		uint32_t	r3;
 		uint32_t	r4;
 		uint32_t	r5;
 		uint32_t	r6;
@@ -60,19 +64,36 @@ typedef union
 		uint32_t	r9;
 		uint32_t	r10;
 		uint32_t	r11;
-		uint32_t	r12;
 		uint32_t	sp;
 		uint32_t	lr;
+		uint32_t	r0;
 	};
-	uint32_t		regs[15];
+	uint32_t		regs[11];
 } registers_t;
 
 
 
 //
-// Thread structure
+// VFP state, d0-d15 followed by fpscr
 //
 typedef struct
+{
+	uint32_t		regs[33];
+} vfp_state_t;
+
+
+
+//
+// FPEXC enable bit
+//
+#define FPEXC_EN					(1 << 30)
+
+
+
+//
+// Thread structure
+//
+struct thread_t
 {
 	// Thread info
 	thread_id_t		thread_id;
@@ -90,28 +111,163 @@ typedef struct
 	// Registers
 	registers_t		registers;
 
+	// VFP registers, only valid while the thread does not own the VFP
+	vfp_state_t		vfp_state;
+
 	// Scheduled time
 	sys_time_t		sched_time;
 
+	// Position in the sleep heap, SLEEP_HEAP_NONE when not in the heap
+	uint32_t		sleep_index;
+
 	// Wait objects
 	union {
-		uint32_t	wait_object;
+		void*		wait_object;
 		event_t*	wait_event;
 		mutex_t*	wait_mutex;
+		sem_t*		wait_sem;
+		cond_t*		wait_cond;
+		rwlock_t*	wait_rwlock;
+		msgq_t*		wait_msgq;
+		const thread_wait_object_t* wait_objects;
 	};
 
-	// Performance data
-	uint32_t		run_count;
-	uint32_t		run_cycles;
+	// Wait queue of the wait object
+	thread_queue_t*	wait_queue;
+
+	// Statistics, and the cycle count at which the thread entered its current state
+	thread_stats_t	stats;
+	uint64_t		state_cycles;
+
+	// Thread list slot
+	uint32_t		slot;
+
+	// Scheduling priority
+	uint32_t		priority;
+
+	// Whether the thread can be preempted when preemption is enabled
+	uint32_t		preemptible;
+
+	// Periodic threads: the release time and absolute deadline of the current job.
+	// The deadline is TIMEOUT_INFINITE for aperiodic threads.
+	sys_time_t		release_time;
+	sys_time_t		job_deadline;
+	thread_period_stats_t period_stats;
+
+	// Cores that the thread may run on, and the core whose ready queues hold the
+	// thread or that last ran it
+	uint32_t		affinity;
+	uint32_t		core;
+
+	// Newlib reentrancy data: errno, stdio state and the buffers of strtok and the
+	// like. The scheduler threads use the global data of newlib instead.
+	struct _reent	reent;
+
+	// Thread-local storage values, indexed by key
+	void*			tls[THREAD_TLS_KEY_COUNT];
+
+	// Ready or wait queue links
+	thread_t*		next;
+	thread_t*		prev;
 	
-} thread_t;
+};
+
+
+
+//
+// Per-core scheduler state. Every core runs its own scheduler thread, which idles
+// and releases stopped threads, and switches between the threads that it runs.
+//
+typedef struct
+{
+	// Scheduler thread of the core
+	thread_t			scheduler;
+
+	// Thread that runs on the core
+	thread_t*			current;
+
+	// Threads that are ready to run on the core, one deque per priority level. The 
+	// core takes threads from the head, idle cores steal them from the tail.
+	thread_queue_t		ready[THREAD_PRIORITY_COUNT];
+
+	// Bit N is set when ready[N] is not empty
+	uint32_t			ready_bitmap;
+
+	// Thread whose state is loaded in the VFP registers of the core. VFP is disabled 
+	// while any other thread runs, so its first VFP instruction traps and the state 
+	// is switched lazily.
+	thread_t*			vfp;
+
+	// Set from the ARM timer interrupt when the quantum of the running thread has elapsed
+	volatile uint32_t	quantum_elapsed;
+
+	// Cycle counter of the core, extended to 64 bits
+	uint64_t			cycles;
+	uint32_t			cycles_last;
+
+} core_t;
+
+
+
+//
+// Scheduler state of the cores. The boot core starts in the scheduler thread, and
+// the startup code enabled VFP for it.
+//
+static core_t cores[RPI_CORE_COUNT] =
+{
+	{
+		.scheduler = { THREAD_SCHEDULER_THREAD_ID, THREAD_STATE_RUNNING, "scheduler", NULL, 0, 0x4000, (void*)0x8000 },
+		.current = &cores[0].scheduler,
+		.vfp = &cores[0].scheduler,
+	},
+};
+
+
+
+//
+// Per-core state of the current core
+//
+#if defined( RPI2 )
+#define this_core_id				_get_core_id()
+#else
+#define this_core_id				0
+#endif
+
+#define this_core					(&cores[this_core_id])
+
+#define scheduler_thread			(this_core->scheduler)
+#define current_thread				(this_core->current)
+#define vfp_owner					(this_core->vfp)
+#define preempt_pending				(this_core->quantum_elapsed)
+#define cycle_count					(this_core->cycles)
+#define cycle_count_last			(this_core->cycles_last)
+
+
+
+#if defined( RPI2 )
+//
+// Only the boot core takes the system timer interrupt. It interrupts the other
+// cores when their cycle count was not extended for this many cycles, which is 
+// well below a wrap even when the timer interrupt is two seconds away.
+//
+#define THREAD_CYCLES_REFRESH		(1ull << 30)
+
+
+
+//
+// Bit N is set while core N waits for a thread to become ready
+//
+static uint32_t idle_cores;
 
 
 
 //
-// Setup the scheduler thread data
+// While a batch of threads is woken, the cores to interrupt are collected and
+// interrupted once when the batch is complete
 //
-thread_t scheduler_thread = { THREAD_SCHEDULER_THREAD_ID, THREAD_STATE_RUNNING, "scheduler", NULL, 0, 0x4000, (void*)0x8000 };
+static uint32_t ipi_batching;
+static uint32_t ipi_batch;
+#endif
 
 
 
@@ -122,6 +278,13 @@ static uint32_t thread_id_counter = THREAD_SCHEDULER_THREAD_ID + 1;
 
 
 
+//
+// Stopped threads, released by the scheduler thread or by the next thread_create
+//
+static thread_queue_t zombie_queue;
+
+
+
 //
 // Thread list
 //
@@ -130,165 +293,1282 @@ static thread_t* thread_list[THREAD_MAX_COUNT];
 
 
 //
-// Current thread
+// Thread objects. The object in slot N is thread_pool[N]; released objects are 
+// kept on the free list, and the pool is used up to thread_pool_count.
+//
+static thread_t thread_pool[THREAD_MAX_COUNT];
+static uint32_t thread_pool_count;
+static thread_queue_t thread_free_list;
+
+
+
+//
+// Released stacks, one list per size class. The link to the next stack is stored 
+// in the stack memory itself.
+//
+#define STACK_CLASS_COUNT			(__builtin_ctz(THREAD_STACK_MAX_SIZE) - __builtin_ctz(THREAD_STACK_MIN_SIZE) + 1)
+static void* stack_pool[STACK_CLASS_COUNT];
+
+
+
+//
+// Thread-local storage keys in use, and their destructors
+//
+static uint32_t tls_keys;
+static thread_tls_destructor_t tls_destructors[THREAD_TLS_KEY_COUNT];
+
+
+
+//
+// Binary min-heap of threads waiting with a finite timeout, ordered by sched_time
+//
+#define SLEEP_HEAP_NONE				((uint32_t)-1)
+static thread_t* sleep_heap[THREAD_MAX_COUNT];
+static uint32_t sleep_heap_count;
+
+
+
+//
+// Whether preemption is enabled
+//
+static uint32_t preempt_enabled;
+
+
+
+//
+// Whether ready periodic threads are ordered by deadline
+//
+static uint32_t edf_enabled;
+
+
+
+//
+// Cycle counts
 //
-static thread_t* current_thread = &scheduler_thread;
+static uint64_t perf_idle_cycles;
+static uint64_t perf_exec_cycles;
 
 
 
 //
-// Tick counts
+// Scheduler trace ring, trace_count is the total number of events logged
 //
-static sys_time_t perf_idle_ticks;
-static sys_time_t perf_exec_ticks;
+static thread_trace_t trace_ring[THREAD_TRACE_COUNT];
+static uint32_t trace_count;
+static uint64_t trace_start_cycles;
+static sys_time_t trace_start_time;
 
 
 
 //
 // Local functions
 //
-static uint32_t switch_to_scheduler();
-static void switch_to_thread(thread_t* thread);
+static uint32_t switch_to_next(uint32_t forced);
+static uint32_t switch_to_thread(thread_t* thread);
+static void thread_wake_expired(sys_time_t time);
 static void thread_stub();
 
 
 
-//
-// External functions
-//
-uint32_t event_acquire_scheduler(event_t* event, thread_id_t thread_id);
-uint32_t mutex_acquire_scheduler(mutex_t* mutex, thread_id_t thread_id);
+//
+// Read the cycle counter. The 32-bit hardware counter wraps within seconds, so it is 
+// extended here; this is called at least on every interrupt, and the system timer
+// interrupt occurs at least every two seconds, so no wrap is missed. Must be called
+// with interrupts disabled.
+//
+static inline uint64_t thread_get_cycles()
+{
+	uint32_t count = _get_cycle_count();
+	cycle_count += count - cycle_count_last;
+	cycle_count_last = count;
+	return cycle_count;
+}
+
+
+
+//
+// Account the cycles since a thread entered its current state to that state
+//
+static inline void thread_account_state(thread_t* thread, uint32_t thread_state, uint64_t cycles)
+{
+#if defined( RPI2 )
+	// The thread may have entered its state on another core, whose counter is 
+	// only approximately aligned with the counter of this core
+	if (cycles > thread->state_cycles)
+		thread->stats.state_cycles[thread_state] += cycles - thread->state_cycles;
+#else
+	thread->stats.state_cycles[thread_state] += cycles - thread->state_cycles;
+#endif
+	thread->state_cycles = cycles;
+}
+
+
+
+//
+// Log a scheduler event in the trace ring
+//
+static inline void thread_trace(uint32_t event, thread_t* thread, uint32_t state, uint32_t object, uint64_t cycles)
+{
+	thread_trace_t* trace = &trace_ring[trace_count++ & (THREAD_TRACE_COUNT - 1)];
+	trace->cycles = cycles;
+	trace->thread_id = thread->thread_id;
+	trace->object = object;
+	trace->event = event;
+	trace->state = state;
+}
+
+
+
+//
+// Append a thread to the tail of a queue
+//
+static inline void thread_queue_push(thread_queue_t* queue, thread_t* thread)
+{
+	thread->next = NULL;
+	thread->prev = queue->tail;
+	if (queue->tail != NULL)
+		queue->tail->next = thread;
+	else
+		queue->head = thread;
+	queue->tail = thread;
+}
+
+
+
+//
+// Remove a thread from anywhere in the queue that holds it
+//
+static inline void thread_queue_remove(thread_queue_t* queue, thread_t* thread)
+{
+	if (thread->prev != NULL)
+		thread->prev->next = thread->next;
+	else
+		queue->head = thread->next;
+	if (thread->next != NULL)
+		thread->next->prev = thread->prev;
+	else
+		queue->tail = thread->prev;
+	thread->next = NULL;
+	thread->prev = NULL;
+}
+
+
+
+//
+// Remove the thread at the head of a queue, returns NULL if the queue is empty
+//
+static inline thread_t* thread_queue_pop(thread_queue_t* queue)
+{
+	thread_t* thread = queue->head;
+	if (thread != NULL)
+		thread_queue_remove(queue, thread);
+	return thread;
+}
+
+
+
+//
+// Insert a thread in a queue after another thread, or at the head if prev is NULL
+//
+static inline void thread_queue_insert(thread_queue_t* queue, thread_t* prev, thread_t* thread)
+{
+	thread->prev = prev;
+	thread->next = prev != NULL ? prev->next : queue->head;
+	if (thread->next != NULL)
+		thread->next->prev = thread;
+	else
+		queue->tail = thread;
+	if (prev != NULL)
+		prev->next = thread;
+	else
+		queue->head = thread;
+}
+
+
+
+#if defined( RPI2 )
+//
+// Interrupt a core, or collect it while a batch of threads is woken
+//
+static inline void thread_send_ipi(uint32_t core)
+{
+	if (ipi_batching)
+		ipi_batch |= 1u << core;
+	else
+		smp_send_ipi(core);
+}
+#endif
+
+
+
+//
+// Append a thread to the ready queue of its priority on the core that last ran it,
+// or on the first core that it may run on. With EDF, a periodic thread is inserted
+// after the threads whose deadline is the same or earlier; aperiodic threads have an
+// infinite deadline, so they stay in round-robin order at the tail.
+//
+static inline void thread_make_ready(thread_t* thread)
+{
+	if (!(thread->affinity & (1u << thread->core)))
+		thread->core = __builtin_ctz(thread->affinity);
+	core_t* core = &cores[thread->core];
+
+	thread_queue_t* queue = &core->ready[thread->priority];
+	if (edf_enabled && thread->job_deadline != TIMEOUT_INFINITE)
+	{
+		thread_t* prev = queue->tail;
+		while (prev != NULL && prev->job_deadline > thread->job_deadline)
+			prev = prev->prev;
+		thread_queue_insert(queue, prev, thread);
+	}
+	else
+	{
+		thread_queue_push(queue, thread);
+	}
+	core->ready_bitmap |= (1u << thread->priority);
+
+#if defined( RPI2 )
+	// Wake the core if it idles, or else an idle core that may steal the thread.
+	// The woken core no longer counts as idle, so the next thread wakes another.
+	uint32_t self = _get_core_id();
+	uint32_t idle = idle_cores & thread->affinity & ~(1u << self);
+	if (idle & (1u << thread->core))
+		idle = 1u << thread->core;
+	if (idle != 0)
+	{
+		uint32_t wake = __builtin_ctz(idle);
+		idle_cores &= ~(1u << wake);
+		thread_send_ipi(wake);
+	}
+
+	// Interrupt a busy core when the thread should preempt the thread it runs
+	else if (thread->core != self && core->current != NULL && thread->priority > core->current->priority)
+	{
+		thread_send_ipi(thread->core);
+	}
+#endif
+}
+
+
+
+//
+// Remove a thread from the ready queues of its core
+//
+static inline void thread_ready_remove(thread_t* thread)
+{
+	core_t* core = &cores[thread->core];
+	thread_queue_remove(&core->ready[thread->priority], thread);
+	if (core->ready[thread->priority].head == NULL)
+		core->ready_bitmap &= ~(1u << thread->priority);
+}
+
+
+
+#if defined( RPI2 )
+//
+// Steal a thread that may run on a core from the ready queues of the other cores,
+// returns NULL when there is none. The thread of the highest priority is taken, 
+// from the tail of its queue: that is the thread which its own core would run last.
+//
+static thread_t* thread_steal(uint32_t core_id)
+{
+	uint32_t core_bit = 1u << core_id;
+	thread_t* stolen = NULL;
+
+	for (uint32_t victim = 0; victim < RPI_CORE_COUNT; victim++)
+	{
+		if (victim == core_id)
+			continue;
+
+		uint32_t bitmap = cores[victim].ready_bitmap;
+		while (bitmap != 0)
+		{
+			// Only a higher priority than the best thread so far is of interest
+			uint32_t priority = 31 - __builtin_clz(bitmap);
+			if (stolen != NULL && priority <= stolen->priority)
+				break;
+
+			thread_t* thread = cores[victim].ready[priority].tail;
+			while (thread != NULL && !(thread->affinity & core_bit))
+				thread = thread->prev;
+			if (thread != NULL)
+			{
+				stolen = thread;
+				break;
+			}
+
+			bitmap &= ~(1u << priority);
+		}
+	}
+
+	if (stolen != NULL)
+		thread_ready_remove(stolen);
+	return stolen;
+}
+#endif
+
+
+
+//
+// Take the next thread from the highest priority ready queue of a core, returns 
+// NULL when no thread is ready. The highest priority is found with a single CLZ.
+// A core without ready threads steals one from the other cores.
+//
+static inline thread_t* thread_next_ready(core_t* core)
+{
+	if (core->ready_bitmap == 0)
+	{
+#if defined( RPI2 )
+		return thread_steal(core - cores);
+#else
+		return NULL;
+#endif
+	}
+
+	uint32_t priority = 31 - __builtin_clz(core->ready_bitmap);
+	thread_t* thread = thread_queue_pop(&core->ready[priority]);
+	if (core->ready[priority].head == NULL)
+		core->ready_bitmap &= ~(1u << priority);
+	return thread;
+}
+
+
+
+//
+// Find a thread by id, returns NULL if the thread does not exist
+//
+static thread_t* thread_find(thread_id_t thread_id)
+{
+	if (thread_id == current_thread->thread_id)
+		return current_thread;
+
+	for (int i = 0; i < THREAD_MAX_COUNT; i++)
+		if (thread_list[i] != NULL && thread_list[i]->thread_id == thread_id)
+			return thread_list[i];
+
+	return NULL;
+}
+
+
+
+//
+// Store a thread at a position in the sleep heap
+//
+static inline void sleep_heap_set(uint32_t index, thread_t* thread)
+{
+	sleep_heap[index] = thread;
+	thread->sleep_index = index;
+}
+
+
+
+//
+// Move the thread at index towards the root until the heap is ordered
+//
+static void sleep_heap_sift_up(uint32_t index)
+{
+	thread_t* thread = sleep_heap[index];
+	while (index > 0)
+	{
+		uint32_t parent = (index - 1) / 2;
+		if (sleep_heap[parent]->sched_time <= thread->sched_time)
+			break;
+		sleep_heap_set(index, sleep_heap[parent]);
+		index = parent;
+	}
+	sleep_heap_set(index, thread);
+}
+
+
+
+//
+// Move the thread at index towards the leaves until the heap is ordered
+//
+static void sleep_heap_sift_down(uint32_t index)
+{
+	thread_t* thread = sleep_heap[index];
+	while (1)
+	{
+		uint32_t child = index * 2 + 1;
+		if (child >= sleep_heap_count)
+			break;
+		if (child + 1 < sleep_heap_count && sleep_heap[child + 1]->sched_time < sleep_heap[child]->sched_time)
+			child++;
+		if (thread->sched_time <= sleep_heap[child]->sched_time)
+			break;
+		sleep_heap_set(index, sleep_heap[child]);
+		index = child;
+	}
+	sleep_heap_set(index, thread);
+}
+
+
+
+//
+// Add a thread to the sleep heap, ordered by its sched_time
+//
+static void sleep_heap_insert(thread_t* thread)
+{
+	ASSERT(thread->sleep_index == SLEEP_HEAP_NONE);
+	ASSERT(sleep_heap_count < THREAD_MAX_COUNT);
+
+	sleep_heap_set(sleep_heap_count++, thread);
+	sleep_heap_sift_up(thread->sleep_index);
+
+	// Let the system timer fire at the new earliest deadline
+	if (thread->sleep_index == 0)
+		sys_timer_set_deadline(thread->sched_time);
+}
+
+
+
+//
+// Remove a thread from the sleep heap
+//
+static void sleep_heap_remove(thread_t* thread)
+{
+	uint32_t index = thread->sleep_index;
+	ASSERT(index < sleep_heap_count && sleep_heap[index] == thread);
+	thread->sleep_index = SLEEP_HEAP_NONE;
+
+	// Move the last thread into the hole and restore heap order
+	thread_t* last = sleep_heap[--sleep_heap_count];
+	if (last != thread)
+	{
+		sleep_heap_set(index, last);
+		if (index > 0 && last->sched_time < sleep_heap[(index - 1) / 2]->sched_time)
+			sleep_heap_sift_up(index);
+		else
+			sleep_heap_sift_down(index);
+	}
+
+	// Let the system timer fire at the new earliest deadline
+	if (index == 0)
+		sys_timer_set_deadline(sleep_heap_count != 0 ? sleep_heap[0]->sched_time : TIMEOUT_INFINITE);
+}
+
+
+
+//
+// Take a thread object and its slot from the pool, returns NULL if all slots are in use
+//
+static thread_t* thread_alloc()
+{
+	thread_t* thread = thread_queue_pop(&thread_free_list);
+	if (thread == NULL && thread_pool_count < THREAD_MAX_COUNT)
+	{
+		thread = &thread_pool[thread_pool_count];
+		thread->slot = thread_pool_count++;
+	}
+	return thread;
+}
+
+
+
+//
+// Return a thread object and its slot to the pool
+//
+static void thread_free(thread_t* thread)
+{
+	// The VFP registers no longer belong to any thread
+	if (vfp_owner == thread)
+		vfp_owner = NULL;
+
+	thread_list[thread->slot] = NULL;
+	thread_queue_push(&thread_free_list, thread);
+}
+
+
+
+//
+// Get the size class of a stack, returns STACK_CLASS_COUNT for stacks that are too large
+//
+static inline uint32_t stack_class(uint32_t stack_size)
+{
+	if (stack_size <= THREAD_STACK_MIN_SIZE)
+		return 0;
+	if (stack_size > THREAD_STACK_MAX_SIZE)
+		return STACK_CLASS_COUNT;
+	return (32 - __builtin_clz(stack_size - 1)) - __builtin_ctz(THREAD_STACK_MIN_SIZE);
+}
+
+
+
+//
+// Allocate a stack, the size is rounded up to its size class
+//
+static void* stack_alloc(uint32_t* stack_size)
+{
+	uint32_t index = stack_class(*stack_size);
+	if (index == STACK_CLASS_COUNT)
+		return malloc(*stack_size);
+
+	// Reuse a released stack of the class, or allocate a new one
+	*stack_size = THREAD_STACK_MIN_SIZE << index;
+	void* stack = stack_pool[index];
+	if (stack != NULL)
+		stack_pool[index] = *(void**)stack;
+	else
+		stack = malloc(*stack_size);
+	return stack;
+}
+
+
+
+//
+// Release a stack into the pool of its size class
+//
+static void stack_free(void* stack, uint32_t stack_size)
+{
+	uint32_t index = stack_class(stack_size);
+	if (index == STACK_CLASS_COUNT)
+	{
+		free(stack);
+		return;
+	}
+
+	*(void**)stack = stack_pool[index];
+	stack_pool[index] = stack;
+}
+
+
+
+//
+// Get the newlib reentrancy data of a thread
+//
+static inline struct _reent* thread_reent(thread_t* thread)
+{
+	return thread->thread_id == THREAD_SCHEDULER_THREAD_ID ? _global_impure_ptr : &thread->reent;
+}
+
+
+
+//
+// Run the destructors of the thread-local values of the current thread. Called
+// with interrupts enabled before the thread stops.
+//
+static void thread_tls_destroy()
+{
+	for (thread_tls_key_t key = 0; key < THREAD_TLS_KEY_COUNT; key++)
+	{
+		void* value = current_thread->tls[key];
+		current_thread->tls[key] = NULL;
+		if (value != NULL && (tls_keys & (1u << key)) && tls_destructors[key] != NULL)
+			tls_destructors[key](value);
+	}
+}
+
+
+
+//
+// Recycle the stack and thread object of stopped threads
+//
+static void thread_release_stopped()
+{
+	thread_t* thread;
+	while ((thread = thread_queue_pop(&zombie_queue)) != NULL)
+	{
+		_reclaim_reent(&thread->reent);
+		stack_free(thread->stack_base, thread->stack_size);
+		thread_free(thread);
+	}
+}
+
+
+
+//
+// Wake a waiting thread with a wait result
+//
+static void thread_wake(thread_t* thread, uint32_t result)
+{
+	// Account the time spent waiting
+	uint64_t cycles = thread_get_cycles();
+	thread_account_state(thread, thread->thread_state, cycles);
+	thread_trace(THREAD_TRACE_WAKE, thread, result, (uint32_t)thread->wait_object, cycles);
+
+	// Set the value returned from the wait
+	thread->registers.r0 = result;
+
+	// Clear the wait object that the thread was waiting for
+	thread->wait_object = NULL;
+	thread->wait_queue = NULL;
+
+	// Mark the thread scheduled and append it to the ready queue
+	thread->thread_state = THREAD_STATE_SCHEDULED;
+	thread_make_ready(thread);
+}
+
+
+
+//
+// Create a thread
+//
+thread_id_t thread_create(uint32_t stack_size, char const* name, thread_fun_t thread_fun, uint32_t thread_arg)
+{
+	// The thread pools are shared with the scheduler
+	uint32_t irq = _save_and_disable_interrupts();
+
+	// Recycle stopped threads first, so their slot and stack can be reused
+	thread_release_stopped();
+
+	// Allocate a thread object and its slot
+	thread_t* thread = thread_alloc();
+	ASSERT(thread != NULL);
+
+	// Allocate stack
+	void* stack_base = stack_alloc(&stack_size);
+	ASSERT(stack_base != NULL);
+
+	// Clear thread data, except for the slot
+	uint32_t slot = thread->slot;
+	memset(thread, 0, sizeof(thread_t));
+	thread->slot = slot;
+
+	// Set thread id and state
+	thread->thread_id = thread_id_counter++;
+	thread->thread_state = THREAD_STATE_STARTING;
+
+	// Copy thread name
+	strncpy(thread->thread_name, name, THREAD_NAME_LEN);
+	thread->thread_name[THREAD_NAME_LEN - 1] = '\x0';
+
+	// New threads start at the default priority and can be preempted
+	thread->priority = THREAD_PRIORITY_DEFAULT;
+	thread->preemptible = 1;
+
+	// New threads start on the creating core, and inherit its affinity. Threads 
+	// created by the scheduler thread may run on any core.
+	thread->core = this_core_id;
+	thread->affinity = current_thread == &scheduler_thread ? THREAD_AFFINITY_ALL : current_thread->affinity;
+
+	// Give the thread its own errno and stdio state
+	_REENT_INIT_PTR(&thread->reent);
+
+	// The thread is not sleeping, and it is aperiodic
+	thread->sleep_index = SLEEP_HEAP_NONE;
+	thread->job_deadline = TIMEOUT_INFINITE;
+
+	// Set thread function and argument, this will be invoked from the stub
+	thread->thread_fun = thread_fun;
+	thread->thread_arg = thread_arg;
+
+	// Set stack
+	thread->stack_size = stack_size;
+	thread->stack_base = stack_base;
+
+	// Set registers
+	thread->registers.sp = (uint32_t)((char*)thread->stack_base + thread->stack_size);
+	thread->registers.lr = (uint32_t)&thread_stub; 
+
+	// Insert the thread in the thread list
+	thread_list[thread->slot] = thread;
+
+	// Now that the thread is ready to run, mark it as scheduled
+	thread->thread_state = THREAD_STATE_SCHEDULED;
+	thread->state_cycles = thread_get_cycles();
+	thread_make_ready(thread);
+
+	// Read the id before the thread can run and exit
+	thread_id_t thread_id = thread->thread_id;
+
+	_restore_interrupts(irq);
+
+	// Return the id of the new thread
+	return thread_id;
+}
+
+
+
+//
+// Exit the current thread
+//
+void thread_exit()
+{
+	ASSERT(thread_get_id() != THREAD_SCHEDULER_THREAD_ID);
+
+	// Release the thread-local values
+	thread_tls_destroy();
+
+	// The scheduler thread releases the thread once it switched away from it
+	_save_and_disable_interrupts();
+
+	// Mark the thread as exiting
+	ASSERT(current_thread->thread_state == THREAD_STATE_RUNNING);
+	current_thread->thread_state = THREAD_STATE_STOPPED;
+
+	// Switch to the next thread
+	switch_to_next(0);
+}
+
+
+
+//
+// Get the current thread id
+//
+thread_id_t thread_get_id(void)
+{
+	return current_thread->thread_id;
+}
+
+
+
+//
+// Get the current thread name
+//
+const char* thread_name(thread_id_t thread_id)
+{
+	// Test scheduler thread (not in thread array)
+	if (thread_id == scheduler_thread.thread_id)
+		return scheduler_thread.thread_name;
+
+	// Search for thread
+	thread_t* thread = thread_find(thread_id);
+	if (thread != NULL)
+		return thread->thread_name;
+
+	// No thread found
+	return "Invalid thread id";
+}
+
+
+
+//
+// Set the priority of a thread
+//
+uint32_t thread_set_priority(thread_id_t thread_id, uint32_t priority)
+{
+	// The scheduler thread does not have a priority
+	if (thread_id == THREAD_SCHEDULER_THREAD_ID || priority >= THREAD_PRIORITY_COUNT)
+		return 0;
+
+	uint32_t irq = _save_and_disable_interrupts();
+
+	// Find the thread
+	thread_t* thread = thread_find(thread_id);
+	if (thread == NULL)
+	{
+		_restore_interrupts(irq);
+		return 0;
+	}
+
+	// A ready thread must move to the queue of its new priority
+	if (thread->thread_state == THREAD_STATE_SCHEDULED && thread->priority != priority)
+	{
+		thread_ready_remove(thread);
+		thread->priority = priority;
+		thread_make_ready(thread);
+	}
+	else
+	{
+		thread->priority = priority;
+	}
+
+	_restore_interrupts(irq);
+	return 1;
+}
+
+
+
+//
+// Get the statistics of a thread
+//
+uint32_t thread_get_stats(thread_id_t thread_id, thread_stats_t* stats)
+{
+	uint32_t irq = _save_and_disable_interrupts();
+
+	// Find the thread
+	thread_t* thread = thread_id == THREAD_SCHEDULER_THREAD_ID ? &scheduler_thread : thread_find(thread_id);
+	if (thread == NULL)
+	{
+		_restore_interrupts(irq);
+		return 0;
+	}
+
+	// Copy the statistics, including the time in the current state so far
+	*stats = thread->stats;
+	stats->state_cycles[thread->thread_state] += thread_get_cycles() - thread->state_cycles;
+
+	_restore_interrupts(irq);
+	return 1;
+}
+
+
+
+//
+// Make a thread periodic
+//
+uint32_t thread_set_periodic(thread_id_t thread_id, uint32_t period, uint32_t deadline)
+{
+	uint32_t irq = _save_and_disable_interrupts();
+
+	// The scheduler thread can't be periodic
+	thread_t* thread = thread_find(thread_id);
+	if (thread == NULL || thread == &scheduler_thread)
+	{
+		_restore_interrupts(irq);
+		return 0;
+	}
+
+	// Reset the statistics and release the first job now
+	memset(&thread->period_stats, 0, sizeof(thread_period_stats_t));
+	if (period != 0)
+	{
+		thread->period_stats.period = period;
+		thread->period_stats.deadline = deadline != 0 ? deadline : period;
+		thread->period_stats.release_count = 1;
+		thread->release_time = sys_timer_get_time();
+		thread->job_deadline = thread->release_time + thread->period_stats.deadline;
+	}
+	else
+	{
+		thread->job_deadline = TIMEOUT_INFINITE;
+	}
+
+	_restore_interrupts(irq);
+	return 1;
+}
+
+
+
+//
+// Complete the job of the current periodic thread and sleep until the next release
+//
+uint32_t thread_wait_period(void)
+{
+	uint32_t irq = _save_and_disable_interrupts();
+
+	thread_t* thread = current_thread;
+	thread_period_stats_t* stats = &thread->period_stats;
+	ASSERT(thread != &scheduler_thread && stats->period != 0);
+
+	// Account the response time of the completed job
+	sys_time_t time = sys_timer_get_time();
+	stats->response_last = (uint32_t)(time - thread->release_time);
+	if (stats->response_last > stats->response_max)
+		stats->response_max = stats->response_last;
+	if (time > thread->job_deadline)
+		stats->miss_count++;
+
+	// Release the next job. When the job overran by whole periods, the releases in 
+	// between are skipped, so the thread does not run a burst of late jobs.
+	uint32_t skipped = 0;
+	thread->release_time += stats->period;
+	while (thread->release_time + stats->period <= time)
+	{
+		thread->release_time += stats->period;
+		skipped++;
+	}
+	thread->job_deadline = thread->release_time + stats->deadline;
+	stats->skip_count += skipped;
+	stats->release_count++;
+
+	// Sleep until the release, unless the job is already late
+	if (thread->release_time > time)
+	{
+		ASSERT(thread->thread_state == THREAD_STATE_RUNNING);
+		thread->thread_state = THREAD_STATE_TIMED_WAIT;
+		thread->sched_time = thread->release_time;
+		switch_to_next(0);
+		time = sys_timer_get_time();
+	}
+
+	// Account the delay from the release until the job runs
+	stats->jitter_last = (uint32_t)(time - thread->release_time);
+	stats->jitter_total += stats->jitter_last;
+	if (stats->jitter_last > stats->jitter_max)
+		stats->jitter_max = stats->jitter_last;
+
+	_restore_interrupts(irq);
+	return skipped;
+}
+
+
+
+//
+// Get the statistics of a periodic thread
+//
+uint32_t thread_get_period_stats(thread_id_t thread_id, thread_period_stats_t* stats)
+{
+	uint32_t irq = _save_and_disable_interrupts();
+
+	thread_t* thread = thread_find(thread_id);
+	if (thread == NULL || thread->period_stats.period == 0)
+	{
+		_restore_interrupts(irq);
+		return 0;
+	}
+
+	*stats = thread->period_stats;
+
+	_restore_interrupts(irq);
+	return 1;
+}
+
+
+
+//
+// Enable earliest-deadline-first scheduling
+//
+void thread_enable_edf(void)
+{
+	edf_enabled = 1;
+}
+
+
+
+//
+// Disable earliest-deadline-first scheduling
+//
+void thread_disable_edf(void)
+{
+	edf_enabled = 0;
+}
+
+
+
+//
+// Allow or prevent preemption of a thread
+//
+uint32_t thread_set_preemptible(thread_id_t thread_id, uint32_t preemptible)
+{
+	uint32_t irq = _save_and_disable_interrupts();
+
+	// The scheduler thread is never preempted
+	thread_t* thread = thread_find(thread_id);
+	if (thread == NULL || thread == &scheduler_thread)
+	{
+		_restore_interrupts(irq);
+		return 0;
+	}
+
+	thread->preemptible = preemptible != 0;
+
+	_restore_interrupts(irq);
+	return 1;
+}
+
+
+
+//
+// Invoked from the ARM timer interrupt when the quantum has elapsed
+//
+static void thread_quantum_elapsed(void)
+{
+#if defined( RPI2 )
+	// The ARM timer interrupts the boot core only, which passes the quantum on
+	for (uint32_t core = 0; core < RPI_CORE_COUNT; core++)
+	{
+		cores[core].quantum_elapsed = 1;
+		if (core != 0 && cores[core].current != NULL)
+			smp_send_ipi(core);
+	}
+#else
+	preempt_pending = 1;
+#endif
+}
+
+
+
+//
+// Enable preemptive time slicing
+//
+void thread_enable_preemption(uint32_t quantum)
+{
+	ASSERT(quantum != 0);
+
+	preempt_pending = 0;
+	preempt_enabled = 1;
+	arm_timer_enable(quantum, &thread_quantum_elapsed);
+}
+
+
+
+//
+// Disable preemptive time slicing
+//
+void thread_disable_preemption(void)
+{
+	arm_timer_disable();
+	preempt_enabled = 0;
+	preempt_pending = 0;
+}
+
+
+
+//
+// Preempt the current thread if needed
+//
+void thread_preempt(void)
+{
+	// Keep the cycle counter extension up to date
+#if defined( RPI2 )
+	uint64_t cycles = thread_get_cycles();
+
+	// The other cores only extend their count on their own interrupts, which an
+	// idle core or a core without preemption may not get for seconds
+	if (_get_core_id() == 0)
+	{
+		for (uint32_t core = 1; core < RPI_CORE_COUNT; core++)
+		{
+			if ((int64_t)(cycles - cores[core].cycles) > (int64_t)THREAD_CYCLES_REFRESH)
+				smp_send_ipi(core);
+		}
+	}
+#else
+	thread_get_cycles();
+#endif
+
+	// Wake threads whose timeout elapsed. The system timer interrupt occurs at
+	// the earliest deadline, so this keeps timeouts accurate on a busy system.
+	if (sleep_heap_count != 0)
+		thread_wake_expired(sys_timer_get_time());
+
+	// Consume the quantum
+	uint32_t quantum_elapsed = preempt_pending;
+	preempt_pending = 0;
+
+	// The scheduler thread and cooperative threads only switch voluntarily
+	if (!preempt_enabled || current_thread == &scheduler_thread || !current_thread->preemptible)
+		return;
+	ASSERT(current_thread->thread_state == THREAD_STATE_RUNNING);
+
+	// Nothing else to run on this core
+	core_t* core = this_core;
+	if (core->ready_bitmap == 0)
+		return;
+
+	// Switch when a higher priority thread is ready, or when the quantum
+	// elapsed and a thread of the same priority is waiting for its turn. With
+	// EDF, a thread of the same priority with an earlier deadline runs first.
+	uint32_t highest = 31 - __builtin_clz(core->ready_bitmap);
+	if (highest > current_thread->priority || (highest == current_thread->priority && (quantum_elapsed ||
+		(edf_enabled && core->ready[highest].head->job_deadline < current_thread->job_deadline))))
+	{
+		current_thread->thread_state = THREAD_STATE_SCHEDULED;
+		switch_to_next(1);
+	}
+}
+
+
+
+//
+// Switch the VFP state to the current thread
+//
+uint32_t thread_vfp_trap(void)
+{
+	// The instruction is not a VFP instruction if VFP was enabled
+	if (_get_fpexc() & FPEXC_EN)
+		return 0;
+	_set_fpexc(FPEXC_EN);
+
+	// Save the state of the previous owner and load the state of the current thread. 
+	// A new thread starts with cleared registers.
+	if (vfp_owner != current_thread)
+	{
+		if (vfp_owner != NULL)
+			_vfp_save(vfp_owner->vfp_state.regs);
+		_vfp_load(current_thread->vfp_state.regs);
+		vfp_owner = current_thread;
+	}
+
+	return 1;
+}
+
+
+
+//
+// Get the priority of a thread
+//
+uint32_t thread_get_priority(thread_id_t thread_id)
+{
+	uint32_t irq = _save_and_disable_interrupts();
+	thread_t* thread = thread_find(thread_id);
+	ASSERT(thread != NULL && thread != &scheduler_thread);
+	uint32_t priority = thread->priority;
+	_restore_interrupts(irq);
+	return priority;
+}
+
+
+
+//
+// Set the cores that a thread may run on
+//
+uint32_t thread_set_affinity(thread_id_t thread_id, uint32_t affinity)
+{
+	// The scheduler threads are bound to their core
+	affinity &= THREAD_AFFINITY_ALL;
+	if (thread_id == THREAD_SCHEDULER_THREAD_ID || affinity == 0)
+		return 0;
+
+	uint32_t irq = _save_and_disable_interrupts();
+
+	// Find the thread
+	thread_t* thread = thread_find(thread_id);
+	if (thread == NULL)
+	{
+		_restore_interrupts(irq);
+		return 0;
+	}
+	thread->affinity = affinity;
+
+	// A ready thread moves to a core that it may run on. A running thread moves
+	// when it is switched out, so the current thread yields if it must move.
+	uint32_t move = !(affinity & (1u << thread->core));
+	if (move && thread->thread_state == THREAD_STATE_SCHEDULED)
+	{
+		thread_ready_remove(thread);
+		thread_make_ready(thread);
+	}
+	move = move && thread == current_thread;
+
+	_restore_interrupts(irq);
+
+	if (move)
+		thread_yield();
+	return 1;
+}
+
 
 
 //
-// Create a thread
+// Get the cores that a thread may run on
 //
-thread_id_t thread_create(uint32_t stack_size, char const* name, thread_fun_t thread_fun, uint32_t thread_arg)
+uint32_t thread_get_affinity(thread_id_t thread_id)
 {
-	// Allocate and clear thread data
-	thread_t* thread = (thread_t*)malloc(sizeof(thread_t));
-	ASSERT(thread != NULL);
-	memset(thread, 0, sizeof(thread_t));
-
-	// Set thread id and state
-	thread->thread_id = thread_id_counter++;
-	thread->thread_state = THREAD_STATE_STARTING;
-
-	// Copy thread name
-	strncpy(thread->thread_name, name, THREAD_NAME_LEN);
-	thread->thread_name[THREAD_NAME_LEN - 1] = '\x0';
+	uint32_t irq = _save_and_disable_interrupts();
+	thread_t* thread = thread_find(thread_id);
+	ASSERT(thread != NULL && thread != &scheduler_thread);
+	uint32_t affinity = thread->affinity;
+	_restore_interrupts(irq);
+	return affinity;
+}
 
-	// Set thread function and argument, this will be invoked from the stub
-	thread->thread_fun = thread_fun;
-	thread->thread_arg = thread_arg;
 
-	// Allocate stack
-	thread->stack_size = stack_size;
-	thread->stack_base = malloc(thread->stack_size);
-	ASSERT(thread->stack_base != NULL);
 
-	// Set registers
-	thread->registers.sp = (uint32_t)((char*)thread->stack_base + thread->stack_size);
-	thread->registers.lr = (uint32_t)&thread_stub; 
+//
+// Allocate a thread-local storage key
+//
+uint32_t thread_tls_alloc(thread_tls_key_t* key, thread_tls_destructor_t destructor)
+{
+	uint32_t irq = _save_and_disable_interrupts();
 
-	// Insert the thread in the thread list
-	int insert_pos = 0;
-	for (; insert_pos < THREAD_MAX_COUNT; insert_pos++)
+	// Find a free key
+	uint32_t free_keys = ~tls_keys & ((1u << THREAD_TLS_KEY_COUNT) - 1);
+	if (free_keys == 0)
 	{
-		if (thread_list[insert_pos] != NULL && thread_list[insert_pos]->thread_state == THREAD_STATE_STOPPED)
-		{
-			free(thread_list[insert_pos]->stack_base);
-			free(thread_list[insert_pos]);
-			thread_list[insert_pos] = NULL;
-		}
-
-		if (thread_list[insert_pos] == NULL)
-		{
-			thread_list[insert_pos] = thread;
-			break;
-		}
+		_restore_interrupts(irq);
+		return 0;
 	}
-	ASSERT(insert_pos < THREAD_MAX_COUNT);
+	*key = __builtin_ctz(free_keys);
+	tls_keys |= (1u << *key);
+	tls_destructors[*key] = destructor;
 
-	// Now that the thread is ready to run, mark it as scheduled
-	thread->thread_state = THREAD_STATE_SCHEDULED;
+	// A new key has no value in any thread, including values left from a freed key
+	for (uint32_t i = 0; i < THREAD_MAX_COUNT; i++)
+	{
+		if (thread_list[i] != NULL)
+			thread_list[i]->tls[*key] = NULL;
+	}
+	for (uint32_t core = 0; core < RPI_CORE_COUNT; core++)
+		cores[core].scheduler.tls[*key] = NULL;
 
-	// Return the id of the new thread
-	return thread->thread_id;
+	_restore_interrupts(irq);
+	return 1;
 }
 
 
 
 //
-// Exit the current thread
+// Free a thread-local storage key. The destructor is not run for the remaining values.
 //
-void thread_exit()
+void thread_tls_free(thread_tls_key_t key)
 {
-	ASSERT(thread_get_id() != THREAD_SCHEDULER_THREAD_ID);
-
-	// Mark the thread as exiting
-	ASSERT(current_thread->thread_state == THREAD_STATE_RUNNING);
-	current_thread->thread_state = THREAD_STATE_STOPPED;
+	ASSERT(key < THREAD_TLS_KEY_COUNT);
 
-	// Yield to the scheduler thread
-	switch_to_scheduler();
+	uint32_t irq = _save_and_disable_interrupts();
+	tls_keys &= ~(1u << key);
+	tls_destructors[key] = NULL;
+	_restore_interrupts(irq);
 }
 
 
 
 //
-// Get the current thread id
+// Set the value of a thread-local storage key for the current thread
 //
-thread_id_t thread_get_id(void)
+void thread_tls_set(thread_tls_key_t key, void* value)
 {
-	return current_thread->thread_id;
+	ASSERT(key < THREAD_TLS_KEY_COUNT && (tls_keys & (1u << key)));
+
+	// The thread may move to another core while it reads the current thread
+	uint32_t irq = _save_and_disable_interrupts();
+	current_thread->tls[key] = value;
+	_restore_interrupts(irq);
 }
 
 
 
 //
-// Get the current thread name
+// Get the value of a thread-local storage key for the current thread
 //
-const char* thread_name(thread_id_t thread_id)
+void* thread_tls_get(thread_tls_key_t key)
 {
-	// Test current thread
-	if (thread_id == current_thread->thread_id)
-		return current_thread->thread_name;
+	ASSERT(key < THREAD_TLS_KEY_COUNT);
 
-	// Test scheduler thread (not in thread array)
-	if (thread_id == scheduler_thread.thread_id)
-		return scheduler_thread.thread_name;
+	uint32_t irq = _save_and_disable_interrupts();
+	void* value = current_thread->tls[key];
+	_restore_interrupts(irq);
+	return value;
+}
 
-	// Search for thread
-	for (int i = 0; i < THREAD_MAX_COUNT; i++)
-		if (thread_list[i]->thread_id == thread_id)
-			return thread_list[i]->thread_name;
 
-	// No thread found
-	return "Invalid thread id";
+
+//
+// Get the newlib reentrancy data of the current thread. Newlib calls this instead
+// of using _impure_ptr when it is built with dynamic reentrancy.
+//
+struct _reent* __getreent(void)
+{
+	uint32_t irq = _save_and_disable_interrupts();
+	struct _reent* reent = thread_reent(current_thread);
+	_restore_interrupts(irq);
+	return reent;
 }
 
 
 
 //
-// Sleep thread
+// Sleep thread until an absolute system time
 //
-void thread_sleep_usec(uint32_t microseconds)
+void thread_sleep_until(sys_time_t sched_time)
 {
 	// The scheduler thread cannot yield
 	// It can spinwait, but I'm not sure that's a good idea...
 	if (thread_get_id() == THREAD_SCHEDULER_THREAD_ID)
 		return;
 
+	uint32_t irq = _save_and_disable_interrupts();
+
 	// Mark the thread as waiting
 	ASSERT(current_thread->thread_state == THREAD_STATE_RUNNING);
 	current_thread->thread_state = THREAD_STATE_TIMED_WAIT;
+	current_thread->sched_time = sched_time;
+
+	// Switch to the next thread
+	switch_to_next(0);
+
+	_restore_interrupts(irq);
+}
 
-	// Set scheduled time
-	current_thread->sched_time = sys_timer_get_time() + microseconds;
 
-	// Yield to the scheduler thread
-	switch_to_scheduler();
+
+//
+// Sleep thread
+//
+void thread_sleep_usec(uint32_t microseconds)
+{
+	thread_sleep_until(sys_timer_get_time() + microseconds);
 }
 
 
@@ -307,6 +1587,26 @@ void thread_sleep_msec(uint32_t milliseconds)
 // Wait for an event
 //
 uint32_t thread_wait_event(event_t* event, sys_time_t timeout)
+{
+	return event_wait(event, timeout);
+}
+
+
+
+//
+// Thread wait for mutex
+//
+uint32_t thread_wait_mutex(mutex_t* mutex, sys_time_t timeout)
+{
+	return mutex_lock(mutex, timeout);
+}
+
+
+
+//
+// Block the current thread on a wait queue
+//
+uint32_t thread_queue_wait(thread_queue_t* queue, uint32_t wait_state, void* wait_object, sys_time_t timeout)
 {
 	ASSERT(thread_get_id() != THREAD_SCHEDULER_THREAD_ID);
 
@@ -314,51 +1614,154 @@ uint32_t thread_wait_event(event_t* event, sys_time_t timeout)
 	if (timeout == 0)
 		return 0;
 
-	// Mark the thread as waiting for event
+	// Calculate the deadline
+	sys_time_t sched_time = TIMEOUT_INFINITE;
+	if (timeout != TIMEOUT_INFINITE)
+		sched_time = sys_timer_get_time() + timeout;
+
+	// Callers usually hold interrupts disabled already, to test the object
+	// state and start waiting without being interrupted
+	uint32_t irq = _save_and_disable_interrupts();
+
+	// Mark the thread as waiting for the object
 	ASSERT(current_thread->thread_state == THREAD_STATE_RUNNING);
-	current_thread->thread_state = THREAD_STATE_EVENT_WAIT;
+	current_thread->thread_state = wait_state;
+	current_thread->sched_time = sched_time;
 
-	// Store the mutex with the thread
-	current_thread->wait_event = event;
+	// Store the object with the thread and queue the thread on the object
+	current_thread->wait_object = wait_object;
+	current_thread->wait_queue = queue;
+	thread_queue_push(queue, current_thread);
 
-	// Set the timeout
-	if (timeout == TIMEOUT_INFINITE)
-		current_thread->sched_time = TIMEOUT_INFINITE;
-	else
-		current_thread->sched_time = sys_timer_get_time() + timeout;
+	// Switch to the next thread, the waker sets the result
+	uint32_t result = switch_to_next(0);
 
-	// Yield to the scheduler thread
-	return switch_to_scheduler();
+	_restore_interrupts(irq);
+	return result;
 }
 
 
 
 //
-// Thread wait for mutex
+// Wake the thread at the head of a wait queue
 //
-uint32_t thread_wait_mutex(mutex_t* mutex, sys_time_t timeout)
+thread_id_t thread_queue_wake_one(thread_queue_t* queue, uint32_t result)
 {
-	ASSERT(thread_get_id() != THREAD_SCHEDULER_THREAD_ID);
+	uint32_t irq = _save_and_disable_interrupts();
 
-	// Early out when the timeout is zero
-	if (timeout == 0)
-		return 0;
+	thread_t* thread = thread_queue_pop(queue);
+	if (thread == NULL)
+	{
+		_restore_interrupts(irq);
+		return THREAD_INVALID_ID;
+	}
 
-	// Mark the thread as waiting for mutex
-	ASSERT(current_thread->thread_state == THREAD_STATE_RUNNING);
-	current_thread->thread_state = THREAD_STATE_MUTEX_WAIT;
+	// Cancel the timeout
+	if (thread->sleep_index != SLEEP_HEAP_NONE)
+		sleep_heap_remove(thread);
+
+	thread_wake(thread, result);
+	thread_id_t thread_id = thread->thread_id;
+
+	_restore_interrupts(irq);
+	return thread_id;
+}
+
+
+
+//
+// Wake all threads on a wait queue. The queue is detached at once and the threads
+// are made ready in one pass, with each core interrupted at most once.
+//
+uint32_t thread_queue_wake_all(thread_queue_t* queue, uint32_t result)
+{
+	uint32_t irq = _save_and_disable_interrupts();
+
+	thread_t* thread = queue->head;
+	queue->head = NULL;
+	queue->tail = NULL;
+
+#if defined( RPI2 )
+	ipi_batching = 1;
+#endif
+
+	uint32_t count = 0;
+	while (thread != NULL)
+	{
+		thread_t* next = thread->next;
+		thread->next = NULL;
+		thread->prev = NULL;
+
+		// Cancel the timeout
+		if (thread->sleep_index != SLEEP_HEAP_NONE)
+			sleep_heap_remove(thread);
+
+		thread_wake(thread, result);
+		thread = next;
+		count++;
+	}
+
+#if defined( RPI2 )
+	// Interrupt the cores that received threads
+	ipi_batching = 0;
+	for (uint32_t cores_left = ipi_batch; cores_left != 0; cores_left &= cores_left - 1)
+		smp_send_ipi(__builtin_ctz(cores_left));
+	ipi_batch = 0;
+#endif
+
+	_restore_interrupts(irq);
+	return count;
+}
 
-	// Store the mutex with the thread
-	current_thread->wait_mutex = mutex;
 
-	// Set the timeout
-	if (timeout == TIMEOUT_INFINITE)
-		current_thread->sched_time = TIMEOUT_INFINITE;
-	else
-		current_thread->sched_time = sys_timer_get_time() + timeout;
 
-	// Yield to the scheduler thread
-	return switch_to_scheduler();
+//
+// Move waiting threads from one wait queue to another
+//
+uint32_t thread_queue_requeue(thread_queue_t* from, thread_queue_t* to, uint32_t count, uint32_t wait_state, void* wait_object)
+{
+	uint32_t irq = _save_and_disable_interrupts();
+	uint64_t cycles = thread_get_cycles();
+
+	// Let the threads wait for the new object, without a timeout
+	uint32_t moved = 0;
+	thread_t* last = NULL;
+	for (thread_t* thread = from->head; thread != NULL && moved < count; thread = thread->next)
+	{
+		if (thread->sleep_index != SLEEP_HEAP_NONE)
+			sleep_heap_remove(thread);
+		thread->sched_time = TIMEOUT_INFINITE;
+
+		thread_account_state(thread, thread->thread_state, cycles);
+		thread->thread_state = wait_state;
+		thread->wait_object = wait_object;
+		thread->wait_queue = to;
+
+		last = thread;
+		moved++;
+	}
+
+	// Splice the moved threads onto the tail of the other queue at once
+	if (last != NULL)
+	{
+		thread_t* first = from->head;
+		from->head = last->next;
+		if (from->head != NULL)
+			from->head->prev = NULL;
+		else
+			from->tail = NULL;
+
+		last->next = NULL;
+		first->prev = to->tail;
+		if (to->tail != NULL)
+			to->tail->next = first;
+		else
+			to->head = first;
+		to->tail = last;
+	}
+
+	_restore_interrupts(irq);
+	return moved;
 }
 
 
@@ -372,12 +1775,16 @@ void thread_yield()
 	if (thread_get_id() == THREAD_SCHEDULER_THREAD_ID)
 		return;
 
+	uint32_t irq = _save_and_disable_interrupts();
+
 	// Mark the current thread as scheduled
 	ASSERT(current_thread->thread_state == THREAD_STATE_RUNNING);
 	current_thread->thread_state = THREAD_STATE_SCHEDULED;
 
-	// Yield to the scheduler thread
-	switch_to_scheduler();
+	// Switch to the next thread
+	switch_to_next(0);
+
+	_restore_interrupts(irq);
 }
 
 
@@ -389,12 +1796,16 @@ void thread_suspend()
 {
 	ASSERT(thread_get_id() != THREAD_SCHEDULER_THREAD_ID);
 
+	uint32_t irq = _save_and_disable_interrupts();
+
 	// Mark the current thread as suspended
 	ASSERT(current_thread->thread_state == THREAD_STATE_RUNNING);
 	current_thread->thread_state = THREAD_STATE_SUSPENDED;
 
-	// Yield to the scheduler thread
-	switch_to_scheduler();
+	// Switch to the next thread
+	switch_to_next(0);
+
+	_restore_interrupts(irq);
 }
 
 
@@ -408,38 +1819,151 @@ void thread_suspend()
 
 
 //
-// Switch to the thread scheduler
+// Switch from the current thread to the next ready thread. The current thread
+// has set the state that it leaves in, and is queued accordingly. Forced is set
+// when the thread is preempted rather than switching away voluntarily. The switch
+// is made directly, the scheduler thread only runs when no thread is ready or
+// when a stopped thread must be released.
+//
+// Note: all thread switches happen with interrupts disabled. A thread that resumes
+//       restores the interrupt state that it saved before it switched away.
 //
-uint32_t switch_to_scheduler()
+uint32_t switch_to_next(uint32_t forced)
 {
-	ASSERT(current_thread != NULL);
-	ASSERT(current_thread != &scheduler_thread);
-	ASSERT(current_thread->thread_state != THREAD_STATE_RUNNING);
+	thread_t* thread = current_thread;
+	ASSERT(thread != &scheduler_thread);
+	ASSERT(thread->thread_state != THREAD_STATE_RUNNING);
 
-	// Set scheduler thread as current_thread
-	thread_t* old_thread = current_thread;
-	current_thread = &scheduler_thread;
+	// Count the switch as forced or voluntary
+	if (forced)
+		thread->stats.preempt_count++;
+	else if (thread->thread_state != THREAD_STATE_STOPPED)
+		thread->stats.yield_count++;
+
+	// Queue the thread according to the state it leaves in. Note that all states should be handled here!
+	switch (thread->thread_state)
+	{
+	// Yielded thread, run it again after the other ready threads of its priority
+	case THREAD_STATE_SCHEDULED:
+		thread_make_ready(thread);
+		break;
+
+	// Sleeping thread, woken when its deadline is the earliest and elapses
+	case THREAD_STATE_TIMED_WAIT:
+		sleep_heap_insert(thread);
+		break;
+
+	// Thread waiting on the wait queue of an object. It is woken by the object 
+	// or, if it has a timeout, when its deadline elapses.
+	case THREAD_STATE_EVENT_WAIT:
+	case THREAD_STATE_MUTEX_WAIT:
+	case THREAD_STATE_SEM_WAIT:
+	case THREAD_STATE_COND_WAIT:
+	case THREAD_STATE_RWLOCK_WAIT:
+	case THREAD_STATE_MSGQ_WAIT:
+	case THREAD_STATE_MULTI_WAIT:
+		if (thread->sched_time != TIMEOUT_INFINITE)
+			sleep_heap_insert(thread);
+		break;
+
+	// Suspended thread, not queued anywhere
+	case THREAD_STATE_SUSPENDED:
+		break;
+
+	// Stopped thread, the thread cannot release the stack it runs on, 
+	// so leave that to the scheduler thread
+	case THREAD_STATE_STOPPED:
+		thread_queue_push(&zombie_queue, thread);
+		return switch_to_thread(&scheduler_thread);
+
+	// Starting or running thread, should not occur!
+	default:
+		ASSERT(false);
+		break;
+	}
+
+	// Wake threads whose timeout elapsed, they may be due before the next thread
+	if (sleep_heap_count != 0)
+		thread_wake_expired(sys_timer_get_time());
+
+	// Take the next thread, or idle in the scheduler thread if there is none
+	thread_t* next = thread_next_ready(this_core);
+	if (next == NULL)
+		next = &scheduler_thread;
+
+	// The thread continues when it is the next thread itself, either because it
+	// yielded and no other thread of its priority is ready, or because its
+	// timeout already elapsed. Return the result that the waker has set.
+	if (next == thread)
+	{
+		thread->thread_state = THREAD_STATE_RUNNING;
+		return thread->registers.r0;
+	}
 
-	// Switch to the scheduler thread
-	return _switch_to_thread(old_thread->registers.regs, scheduler_thread.registers.regs);
+	return switch_to_thread(next);
 }
 
 
 
 //
-// Switch to a thread
+// Switch from the current thread to a thread, returns the value that was
+// stored in r0 of the current thread when it is resumed
 //
-void switch_to_thread(thread_t* thread)
+uint32_t switch_to_thread(thread_t* thread)
 {
-	ASSERT(current_thread == &scheduler_thread);
-	ASSERT(thread->thread_state != THREAD_STATE_RUNNING);
+	ASSERT(thread != current_thread);
+	ASSERT(thread == &scheduler_thread || thread->thread_state == THREAD_STATE_SCHEDULED);
+
+	// Account the cycles run by the current thread, and the cycles that 
+	// the new thread was ready to run
+	uint64_t cycles = thread_get_cycles();
+	if (current_thread != &scheduler_thread)
+		perf_exec_cycles += cycles - current_thread->state_cycles;
+	thread_account_state(current_thread, THREAD_STATE_RUNNING, cycles);
+	thread_account_state(thread, thread->thread_state, cycles);
+	thread->stats.switch_count++;
+
+	// Trace the switch
+	thread_trace(THREAD_TRACE_SWITCH_OUT, current_thread, current_thread->thread_state, (uint32_t)current_thread->wait_object, cycles);
+	thread_trace(THREAD_TRACE_SWITCH_IN, thread, THREAD_STATE_RUNNING, current_thread->thread_id, cycles);
 
 	// Set current thread
+	thread_t* old_thread = current_thread;
 	current_thread = thread;
 	current_thread->thread_state = THREAD_STATE_RUNNING;
+	current_thread->core = this_core_id;
+
+	// Point newlib at the reentrancy data of the thread. Multi-core builds use
+	// __getreent instead.
+#if !defined( RPI2 )
+	_impure_ptr = thread_reent(thread);
+#endif
+
+#if defined( RPI2 )
+	// Another core may resume the old thread, so its VFP state must be saved 
+	// now. The VFP state is still switched lazily when a thread is switched in.
+	if (old_thread == vfp_owner)
+	{
+		_vfp_save(old_thread->vfp_state.regs);
+		vfp_owner = NULL;
+	}
+#endif
+
+	// Enable VFP only if it holds the state of the thread
+	_set_fpexc(thread == vfp_owner ? FPEXC_EN : 0);
+
+	// Start a fresh quantum for the thread. The cores share the ARM timer, so
+	// on multi-core builds the quantum is a periodic tick instead.
+	if (thread != &scheduler_thread && preempt_enabled)
+	{
+#if !defined( RPI2 )
+		arm_timer_restart();
+#endif
+		preempt_pending = 0;
+	}
 
 	// Switch to the thread
-	_switch_to_thread(scheduler_thread.registers.regs, current_thread->registers.regs);
+	return _switch_to_thread(old_thread->registers.regs, thread->registers.regs);
 }
 
 
@@ -466,13 +1990,13 @@ void thread_print_list()
 	uint32_t day = tsec;
 
 	// Calculate performance
-	static sys_time_t prev_exec_ticks = 0;
-	static sys_time_t prev_idle_ticks = 0;
-	sys_time_t cur_exec_ticks = perf_exec_ticks - prev_exec_ticks;
-	sys_time_t cur_idle_ticks = perf_idle_ticks - prev_idle_ticks;
-	prev_exec_ticks = perf_exec_ticks;
-	prev_idle_ticks = perf_idle_ticks;	
-	float busy = (float)cur_exec_ticks / (float)cur_idle_ticks * 100.0f;
+	static uint64_t prev_exec_cycles = 0;
+	static uint64_t prev_idle_cycles = 0;
+	uint64_t cur_exec_cycles = perf_exec_cycles - prev_exec_cycles;
+	uint64_t cur_idle_cycles = perf_idle_cycles - prev_idle_cycles;
+	prev_exec_cycles = perf_exec_cycles;
+	prev_idle_cycles = perf_idle_cycles;	
+	float busy = (float)cur_exec_cycles / (float)cur_idle_cycles * 100.0f;
 
 	// Start at buffer start
 	char* buf_ptr = buf;
@@ -482,21 +2006,49 @@ void thread_print_list()
 		day, hrs, min, sec, msec, busy);
 
 	// Write header
-	buf_ptr += sprintf(buf_ptr, "  Slot        ID    Name              Runcount        Time      State              Time    WaitObject\n");
+	buf_ptr += sprintf(buf_ptr, "  Slot        ID    Name            Pri      Runcount     Mcycles      State              Time    WaitObject\n");
 
 	// Write threads
 	for (int i = 0; i < THREAD_MAX_COUNT; i++)
 	{
+		// Threads may change or exit while the list is written, so copy
+		// the thread data with interrupts disabled
+		uint32_t irq = _save_and_disable_interrupts();
+
 		// Get thread, skip empty slots
 		thread_t* thread = thread_list[i];
 		if (thread == NULL)
+		{
+			_restore_interrupts(irq);
 			continue;
+		}
 
-		// Copy thread state
+		// Copy thread data
+		char name[THREAD_NAME_LEN];
+		strcpy(name, thread->thread_name);
+		thread_id_t thread_id = thread->thread_id;
+		uint32_t priority = thread->priority;
+		uint32_t run_count = thread->stats.switch_count;
+		uint32_t run_cycles = thread->stats.state_cycles[THREAD_STATE_RUNNING] / 1000000;
 		uint32_t thread_state = thread->thread_state;
+		sys_time_t sched_time = thread->sched_time;
+		const char* wait_name = "";
+		if (thread_state == THREAD_STATE_EVENT_WAIT)
+			wait_name = event_get_name(thread->wait_event);
+		else if (thread_state == THREAD_STATE_MUTEX_WAIT)
+			wait_name = mutex_get_name(thread->wait_mutex);
+		else if (thread_state == THREAD_STATE_SEM_WAIT)
+			wait_name = sem_get_name(thread->wait_sem);
+		else if (thread_state == THREAD_STATE_COND_WAIT)
+			wait_name = cond_get_name(thread->wait_cond);
+		else if (thread_state == THREAD_STATE_RWLOCK_WAIT)
+			wait_name = rwlock_get_name(thread->wait_rwlock);
+		else if (thread_state == THREAD_STATE_MSGQ_WAIT)
+			wait_name = msgq_get_name(thread->wait_msgq);
+
+		_restore_interrupts(irq);
 
 		// Calculate time remaining
-		sys_time_t sched_time = thread->sched_time;
 		if (sched_time <= time)
 		{
 			// No more time remaining, mark scheduled
@@ -517,16 +2069,21 @@ void thread_print_list()
 		case THREAD_STATE_SCHEDULED:	sprintf(state_string, "Scheduled"); break;
 		case THREAD_STATE_RUNNING:		sprintf(state_string, "Running  ");	break;
 		case THREAD_STATE_TIMED_WAIT:	sprintf(state_string, "TimedWait    %10u", (uint32_t)sched_time); break;
-		case THREAD_STATE_EVENT_WAIT:	sprintf(state_string, "EventWait    %10u    %s", (uint32_t)sched_time, event_get_name(thread->wait_event)); break;
-		case THREAD_STATE_MUTEX_WAIT:	sprintf(state_string, "MutexWait    %10u    %s", (uint32_t)sched_time, mutex_get_name(thread->wait_mutex)); break;
+		case THREAD_STATE_EVENT_WAIT:	sprintf(state_string, "EventWait    %10u    %s", (uint32_t)sched_time, wait_name); break;
+		case THREAD_STATE_MUTEX_WAIT:	sprintf(state_string, "MutexWait    %10u    %s", (uint32_t)sched_time, wait_name); break;
+		case THREAD_STATE_SEM_WAIT:		sprintf(state_string, "SemWait      %10u    %s", (uint32_t)sched_time, wait_name); break;
+		case THREAD_STATE_COND_WAIT:	sprintf(state_string, "CondWait     %10u    %s", (uint32_t)sched_time, wait_name); break;
+		case THREAD_STATE_RWLOCK_WAIT:	sprintf(state_string, "RwlockWait   %10u    %s", (uint32_t)sched_time, wait_name); break;
+		case THREAD_STATE_MSGQ_WAIT:	sprintf(state_string, "MsgqWait     %10u    %s", (uint32_t)sched_time, wait_name); break;
+		case THREAD_STATE_MULTI_WAIT:	sprintf(state_string, "MultiWait    %10u", (uint32_t)sched_time); break;
 		case THREAD_STATE_SUSPENDED:	sprintf(state_string, "Suspended "); break;
 		case THREAD_STATE_STOPPED:		sprintf(state_string, "Stopped   "); break;
 		default:						sprintf(state_string, "Unknown   "); break;
 		}
 
 		// Write thread info string to buffer
-		buf_ptr += sprintf(buf_ptr, "%6u    %6u    %-12.12s    %10u    %10u    %s", 
-			i, thread->thread_id, thread->thread_name, thread->run_count, thread->run_cycles/1000, state_string);
+		buf_ptr += sprintf(buf_ptr, "%6u    %6u    %-12.12s    %3u    %10u    %10u    %s", 
+			i, thread_id, name, priority, run_count, run_cycles, state_string);
 		
 		// Pad buffer
 		while ((buf_ptr - buf) % 120 != 0)
@@ -555,140 +2112,196 @@ void thread_print_list()
 
 
 //
-// This is the scheduler thread
+// Send the scheduler trace to the host
 //
-void thread_scheduler()
+void thread_trace_dump()
 {
-	// Make sure the scheduler is not called by any thread other than the initial thread
-	ASSERT(thread_get_id() == THREAD_SCHEDULER_THREAD_ID);
-	
-	TRACE("Scheduler started");
-
-	// Start at last index so thread[0] will run first
-	uint32_t cur_idx = THREAD_MAX_COUNT - 1;
-	uint32_t prv_idx = cur_idx;
-
-	// Scheduler main loop
-	while (1)
+	// Allocate a buffer for the marker, length and data
+	uint32_t max_size = 5 + sizeof(thread_trace_header_t) + sizeof(trace_ring) + (THREAD_MAX_COUNT + 1) * sizeof(thread_trace_name_t);
+	uint8_t* buf = (uint8_t*)malloc(max_size);
+	ASSERT(buf != NULL);
+
+	thread_trace_header_t* header = (thread_trace_header_t*)(buf + 5);
+	thread_trace_t* records = (thread_trace_t*)(header + 1);
+
+	// Take a consistent copy of the trace
+	uint32_t irq = _save_and_disable_interrupts();
+
+	// Copy the records, oldest first
+	uint32_t record_count = trace_count < THREAD_TRACE_COUNT ? trace_count : THREAD_TRACE_COUNT;
+	for (uint32_t i = 0; i < record_count; i++)
+		records[i] = trace_ring[(trace_count - record_count + i) & (THREAD_TRACE_COUNT - 1)];
+
+	// Copy the names of the scheduler and the live threads
+	thread_trace_name_t* names = (thread_trace_name_t*)(records + record_count);
+	uint32_t name_count = 0;
+	names[name_count].thread_id = scheduler_thread.thread_id;
+	strcpy(names[name_count++].name, scheduler_thread.thread_name);
+	for (int i = 0; i < THREAD_MAX_COUNT; i++)
 	{
-		// Calculate next slot, fold to zero at THREAD_MAX_COUNT
-		cur_idx = ((cur_idx + 1) & (THREAD_MAX_COUNT - 1));
+		if (thread_list[i] != NULL)
+		{
+			names[name_count].thread_id = thread_list[i]->thread_id;
+			strcpy(names[name_count++].name, thread_list[i]->thread_name);
+		}
+	}
 
-		// Get the thread in the slot, which may be NULL
-		thread_t* thread = thread_list[cur_idx];
-		if (thread == NULL)
-			continue;
+	// Fill the header
+	header->magic = THREAD_TRACE_MAGIC;
+	header->record_count = record_count;
+	header->name_count = name_count;
+	header->reserved = 0;
+	header->start_cycles = trace_start_cycles;
+	header->start_time = trace_start_time;
+	header->dump_cycles = thread_get_cycles();
+	header->dump_time = sys_timer_get_time();
+
+	_restore_interrupts(irq);
+
+	// Write the marker and the length, then send everything at once
+	uint32_t size = (uint8_t*)(names + name_count) - (uint8_t*)header;
+	buf[0] = THREAD_TRACE_MARKER;
+	buf[1] = (uint8_t)(size >>  0);
+	buf[2] = (uint8_t)(size >>  8);
+	buf[3] = (uint8_t)(size >> 16);
+	buf[4] = (uint8_t)(size >> 24);
+	uart_write(buf, size + 5);
+
+	free(buf);
+}
 
-		// The scheduler thread should never appear in the thread list
-		ASSERT(thread != &scheduler_thread);
 
-		// If the current thread matches the last one that ran, all threads have
-		// been checked and found not eligible to run, so wait for interrupts.
-		// The system timer will resume the scheduler when its interrupt occurs.
-		// This effectively keeps the CPU in low power mode unless there is work.
-		if (cur_idx == prv_idx)
-		{
-			sys_time_t before = sys_timer_get_time();
 
-			_wait_for_interrupt();
+//
+// Wake the threads whose timeout has elapsed, in deadline order
+//
+static void thread_wake_expired(sys_time_t time)
+{
+	while (sleep_heap_count != 0 && sleep_heap[0]->sched_time <= time)
+	{
+		thread_t* thread = sleep_heap[0];
+		sleep_heap_remove(thread);
 
-			sys_time_t after = sys_timer_get_time();
-			perf_idle_ticks += (after - before);
+		// A sleep completes successfully, an event or mutex wait times out
+		if (thread->thread_state == THREAD_STATE_TIMED_WAIT)
+		{
+			thread_wake(thread, 1);
 		}
-
-		// Get the current time
-		sys_time_t time = sys_timer_get_time();
-
-		// Handle thread states. Note that all states should be handled here!
-		switch (thread->thread_state)
+		else
 		{
-		// Starting thread, cannot run yet
-		case THREAD_STATE_STARTING:
-			continue;
-
-		// Next scheduled thread, run it
-		case THREAD_STATE_SCHEDULED:
-			break;
+			thread_queue_remove(thread->wait_queue, thread);
+			thread_wake(thread, 0);
+		}
+	}
+}
 
-		// Running thread, should not occur!
-		case THREAD_STATE_RUNNING:
-			ASSERT(false);
-			continue;
 
-		// Thread waiting for timespan
-		case THREAD_STATE_TIMED_WAIT:
-			if (thread->sched_time <= time)
-			{
-				thread->registers.r0 = 1;
-				break;
-			}
-			continue;
 
-		// Thread waiting for event
-		case THREAD_STATE_EVENT_WAIT:
-			if (event_acquire_scheduler(thread->wait_event, thread->thread_id))
-			{
-				thread->registers.r0 = 1;
-				break;
-			}
-			if (thread->sched_time <= time)
-			{
-				thread->registers.r0 = 0;
-				break;
-			}
-			continue;
+//
+// This is the scheduler thread
+//
+void thread_scheduler()
+{
+	core_t* core = this_core;
 
-		// Thread waiting for mutex
-		case THREAD_STATE_MUTEX_WAIT:
-			if (mutex_acquire_scheduler(thread->wait_mutex, thread->thread_id))
-			{
-				thread->registers.r0 = 1;
-				break;
-			}
-			if (thread->sched_time <= time)
-			{
-				thread->registers.r0 = 0;
-				break;
-			}
-			continue;
+#if defined( RPI2 )
+	// Secondary cores enter here from their startup code, which enabled VFP
+	if (core->current == NULL)
+	{
+		core->scheduler.thread_id = THREAD_SCHEDULER_THREAD_ID;
+		core->scheduler.thread_state = THREAD_STATE_RUNNING;
+		strcpy(core->scheduler.thread_name, "scheduler");
+		core->current = &core->scheduler;
+		core->vfp = &core->scheduler;
+	}
+#endif
 
+	// Make sure the scheduler is not called by any thread other than the initial thread
+	ASSERT(thread_get_id() == THREAD_SCHEDULER_THREAD_ID);
+	
+	TRACE("Scheduler started");
 
-		// Suspended thread, continue scanning
-		case THREAD_STATE_SUSPENDED:
-			continue;
+	// The cycle counter of the boot core was started by _cmain, before the first
+	// thread was created
+	if (core == &cores[0])
+	{
+		// The trace relates cycles to time from here
+		trace_start_cycles = thread_get_cycles();
+		trace_start_time = sys_timer_get_time();
+
+#if defined( RPI2 )
+		// Start the schedulers of the other cores
+		smp_start_cores();
+#endif
+	}
+#if defined( RPI2 )
+	else
+	{
+		// Start the cycle counter of this core, and align the cycle count with
+		// the boot core, so the time that a thread spends in a state can be
+		// measured across cores
+		_enable_cycle_counter();
+		cycle_count_last = _get_cycle_count();
+		core->cycles = cores[0].cycles;
+
+		// Interrupts are disabled by the startup code
+		_enable_interrupts();
+	}
+#endif
 
+	// Scheduler main loop. Threads switch to each other directly, so the 
+	// scheduler thread only runs to release stopped threads and to idle.
+	while (1)
+	{
+		// The scheduler data is shared with interrupt handlers and preempted threads
+		uint32_t irq = _save_and_disable_interrupts();
+
+		// Recycle stopped threads
+		thread_release_stopped();
+
+		// Wake threads whose timeout elapsed. Only the earliest deadline needs 
+		// to be compared, so the clock is not read while nothing is due.
+		if (sleep_heap_count != 0)
+			thread_wake_expired(sys_timer_get_time());
+
+		// Take the next thread from the ready queues. If there is none, no thread
+		// is eligible to run, so wait for interrupts. The system timer is programmed
+		// for the earliest thread deadline, so this keeps the CPU in low power mode
+		// until there is work. Interrupts stay disabled until
+		// after the wait: a pending interrupt still ends the wait, and it cannot 
+		// make a thread ready between the check and the wait.
+		thread_t* thread = thread_next_ready(core);
+		if (thread == NULL)
+		{
+			uint64_t before = thread_get_cycles();
+
+#if defined( RPI2 )
+			// Let the other cores run while this core waits. A core that makes 
+			// a thread ready sends an interrupt to an idle core, which ends the
+			// wait.
+			uint32_t core_bit = 1u << (core - cores);
+			idle_cores |= core_bit;
+			_kernel_unlock();
+			_wait_for_interrupt();
+			_kernel_lock();
+			idle_cores &= ~core_bit;
+#else
+			_wait_for_interrupt();
+#endif
 
-		// Stopped thread, clear thread data and continue
-		case THREAD_STATE_STOPPED:
-			free(thread->stack_base);
-			free(thread);
-			thread_list[cur_idx] = NULL;
-			continue;
+			uint64_t after = thread_get_cycles();
+			perf_idle_cycles += (after - before);
 		}
+		else
+		{
+			// The scheduler thread should never appear in the ready queue
+			ASSERT(thread != &scheduler_thread);
 
-		// Mark this slot as the one to scan from. When the scan returns to this point
-		// without finding an eligible thread, the list has been scanned completely.
-		prv_idx = cur_idx;
-
-		// Clear the wait object that the thread was waiting for
-		thread->wait_object = 0;
-
-		// Take start time
-		sys_time_t before = sys_timer_get_time();
-
-		// Switch to the thread that was found
-		switch_to_thread(thread);
-
-		// Take time elapsed
-		sys_time_t after = sys_timer_get_time();
-		sys_time_t elapsed = after - before;
-
-		// Update thread performance data
-		thread->run_count++;
-		thread->run_cycles += elapsed;
+			// Run threads until none is ready
+			switch_to_thread(thread);
+		}
 
-		// Update scheduler performance data
-		perf_exec_ticks += elapsed;
+		_restore_interrupts(irq);
 	}
 }
 
@@ -701,12 +2314,20 @@ void thread_stub()
 {
 	ASSERT(thread_get_id() != THREAD_SCHEDULER_THREAD_ID);
 
+	// Threads are switched in with interrupts disabled, and a new thread 
+	// has no saved interrupt state to restore
+	_enable_interrupts();
+
 	// Run the thread function
 	current_thread->thread_fun(current_thread->thread_arg);
 
+	// Release the thread-local values
+	thread_tls_destroy();
+
 	// Mark the thread as stopped
+	_save_and_disable_interrupts();
 	current_thread->thread_state = THREAD_STATE_STOPPED;
 
-	// Yield to the scheduler thread
-	switch_to_scheduler();
+	// Switch to the next thread
+	switch_to_next(0);
 }
@@ -22,6 +22,9 @@
 #include "rpi-mutex.h"
 #include "rpi-thread.h"
 #include "rpi-systimer.h"
+#include "rpi-task.h"
+#include "rpi-sem.h"
+#include "rpi-spsc.h"
 #include "asm-functions.h"
 
 #include <stdio.h>
@@ -47,6 +50,92 @@ static mutex_t* uart_mutex = 0;
 
 
 
+//
+// Receive ring, filled by the RX interrupt handler and drained by uart_read. The
+// semaphore is posted after bytes are pushed, it saturates at one so it only 
+// records that the ring may have data.
+//
+#define UART_RX_BUFFER_SIZE		256
+
+static uint8_t uart_rx_storage[UART_RX_BUFFER_SIZE];
+static spsc_t uart_rx_ring;
+static sem_t* uart_rx_sem;
+
+
+
+//
+// Handler for the RX interrupts, called by the UART interrupt handler
+//
+static irq_handler_t uart_rx_irq_handler;
+
+
+
+//
+// Signaled by the TX interrupt when the TX FIFO has drained below its trigger level,
+// if a writer waits for space. The interrupt is only enabled while a writer waits.
+//
+static event_t* uart_tx_event;
+static volatile uint32_t uart_tx_waiting;
+
+
+
+//
+// Tasks waiting for received bytes and for TX space, resumed by the interrupts
+//
+static task_queue_t uart_rx_tasks;
+static task_queue_t uart_tx_tasks;
+
+
+
+//
+// Flag register bits
+//
+#define UART_FR_RXFE			(1 << 4)
+#define UART_FR_TXFF			(1 << 5)
+
+
+
+//
+// UART interrupt handler, passes RX interrupts on to the RX handler and wakes the 
+// writers that wait for TX space. Without an RX handler, the RX interrupts are
+// only enabled while tasks wait, and resume them.
+//
+static void uart_irq_handler(void)
+{
+	uint32_t mis = rpi_uart->mis;
+
+	// Mask the TX interrupt until the next writer waits, the FIFO stays below
+	// the trigger level until it is written again
+	if (mis & UART0_TXIM)
+	{
+		rpi_uart->imsc &= ~UART0_TXIM;
+		rpi_uart->icr = UART0_TXIM;
+		if (uart_tx_waiting)
+		{
+			uart_tx_waiting = 0;
+			event_signal(uart_tx_event);
+		}
+		task_queue_wake_all(&uart_tx_tasks, 1);
+	}
+
+	if (mis & (UART0_RXIM | UART0_RTIM))
+	{
+		if (uart_rx_irq_handler != NULL)
+		{
+			uart_rx_irq_handler();
+		}
+		else
+		{
+			// The tasks read the bytes from the FIFO
+			rpi_uart->imsc &= ~(UART0_RXIM | UART0_RTIM);
+			rpi_uart->icr = UART0_RXIM | UART0_RTIM;
+			task_queue_wake_all(&uart_rx_tasks, 1);
+		}
+	}
+}
+
+
+
 //
 // Enable the PL011 UART
 // 
@@ -84,9 +173,8 @@ void uart_enable()
 	// Enable FIFO & 8 bit data transmission (1 stop bit, no parity)
 	rpi_uart->lcrh = (1 << 4) | (1 << 5) | (1 << 6);
 
-	// Mask all interrupts
-	rpi_uart->imsc = UART0_OEIM | UART0_BEIM | UART0_PEIM | UART0_FEIM | 
-		UART0_RTIM | UART0_TXIM | UART0_RXIM | UART0_CTSMIM;
+	// Mask all interrupts. A set bit in IMSC enables the interrupt.
+	rpi_uart->imsc = 0;
 
 	// Enable UART0, receive & transfer part of UART
 	rpi_uart->cr = (1 << 0) | (1 << 8) | (1 << 9);
@@ -99,6 +187,10 @@ void uart_enable()
 	uart_mutex = mutex_create("UART");
 #endif
 
+	// Handle the UART interrupt, all sources are still masked
+	uart_tx_event = event_create("UART TX", EVENT_TYPE_AUTO);
+	register_irq_handler(57, &uart_irq_handler);
+
 	TRACE("Enabled PL011 UART");
 }
 
@@ -133,14 +225,19 @@ void uart_term()
 //
 void uart_enable_rx_interrupt(irq_handler_t handler)
 {
+	uint32_t irq = _save_and_disable_interrupts();
+
 	// Clear interrupt status
-	rpi_uart->icr = 0x7FF;
+	rpi_uart->icr = UART0_RXIM | UART0_RTIM;
 
-	// Register the handler for the uart interrupt
-	register_irq_handler(57, handler);
+	// Set the handler for the RX interrupts
+	uart_rx_irq_handler = handler;
 
-	// Enable the RX interrupt
-	rpi_uart->imsc &= ~UART0_RXIM;
+	// Enable the RX interrupt, and the receive timeout interrupt for bytes
+	// that stay below the FIFO level
+	rpi_uart->imsc |= UART0_RXIM | UART0_RTIM;
+
+	_restore_interrupts(irq);
 }
 
 
@@ -150,11 +247,15 @@ void uart_enable_rx_interrupt(irq_handler_t handler)
 //
 void uart_disable_rx_interrupt()
 {
+	uint32_t irq = _save_and_disable_interrupts();
+
 	// Disable the interrupt
-	rpi_uart->imsc |= UART0_RXIM;
+	rpi_uart->imsc &= ~(UART0_RXIM | UART0_RTIM);
 
-	// Unregister the handler
-	unregister_irq_handler(57);
+	// Remove the handler
+	uart_rx_irq_handler = NULL;
+
+	_restore_interrupts(irq);
 }
 
 
@@ -174,7 +275,7 @@ void uart_disable_rx_interrupt()
 //
 uint8_t uart_trygetc_nolock(uint8_t* byte)
 {
-	if ((rpi_uart->fr & (1 << 4)) != 0)
+	if ((rpi_uart->fr & UART_FR_RXFE) != 0)
 		return 0;
 
 	*byte = rpi_uart->dr;
@@ -203,7 +304,7 @@ uint8_t uart_getc_nolock(void)
 //
 uint8_t uart_tryputc_nolock(uint8_t byte)
 {
-	if ((rpi_uart->fr  & (1 << 5)) != 0)
+	if ((rpi_uart->fr & UART_FR_TXFF) != 0)
 		return 0;
 
 	rpi_uart->dr = byte;
@@ -245,6 +346,131 @@ void uart_puts_nolock(const char *str)
 
 
 
+//////////////////////////////////////////////////////////////////////////
+//
+// Interrupt driven receive
+//
+//////////////////////////////////////////////////////////////////////////
+
+
+
+//
+// RX interrupt handler, moves the received bytes from the FIFO to the receive 
+// ring and resumes the receiving tasks. Bytes are dropped when the ring is full.
+//
+static void uart_rx_handler(void)
+{
+	uint8_t byte;
+	while (uart_trygetc_nolock(&byte))
+		spsc_push(&uart_rx_ring, &byte);
+
+	rpi_uart->icr = UART0_RXIM | UART0_RTIM;
+	sem_post(uart_rx_sem);
+	task_queue_wake_all(&uart_rx_tasks, 1);
+}
+
+
+
+//
+// Receive through the RX interrupt and the receive ring
+//
+void uart_enable_rx_buffer(void)
+{
+	spsc_init(&uart_rx_ring, uart_rx_storage, 1, UART_RX_BUFFER_SIZE);
+	uart_rx_sem = sem_create("UART RX", 0, 1);
+	uart_enable_rx_interrupt(&uart_rx_handler);
+}
+
+
+
+//
+// Read up to len received bytes
+//
+uint32_t uart_read(void* data, uint32_t len, sys_time_t timeout)
+{
+	sys_time_t deadline = TIMEOUT_INFINITE;
+	if (timeout != TIMEOUT_INFINITE)
+		deadline = sys_timer_get_time() + timeout;
+
+	// The semaphore can be posted for bytes that were already read, so wait 
+	// again until bytes arrive or the deadline passes
+	uint32_t count;
+	while ((count = spsc_pop_bulk(&uart_rx_ring, data, len)) == 0)
+	{
+		sys_time_t remaining = TIMEOUT_INFINITE;
+		if (deadline != TIMEOUT_INFINITE)
+		{
+			sys_time_t time = sys_timer_get_time();
+			remaining = deadline > time ? deadline - time : 0;
+		}
+
+		if (!sem_wait(uart_rx_sem, remaining))
+			return spsc_pop_bulk(&uart_rx_ring, data, len);
+	}
+
+	return count;
+}
+
+
+
+//
+// Queue a task until the RX interrupt reports a received byte. When a byte is 
+// there already, the UART was locked by a thread, and the task retries after the 
+// other ready tasks.
+//
+uint32_t uart_wait_rx_task(task_t* task)
+{
+	uint32_t irq = _save_and_disable_interrupts();
+
+	if (uart_rx_sem != NULL)
+	{
+		// The RX interrupt is enabled and fills the receive ring
+		if (spsc_count(&uart_rx_ring) == 0)
+			task_queue_wait(&uart_rx_tasks, task, TIMEOUT_INFINITE);
+		else
+			task_yield(task);
+	}
+	else if ((rpi_uart->fr & UART_FR_RXFE) != 0)
+	{
+		task_queue_wait(&uart_rx_tasks, task, TIMEOUT_INFINITE);
+		rpi_uart->imsc |= UART0_RXIM | UART0_RTIM;
+	}
+	else
+	{
+		task_yield(task);
+	}
+
+	_restore_interrupts(irq);
+	return TASK_WAITING;
+}
+
+
+
+//
+// Queue a task until the TX interrupt reports space in the TX FIFO. When there is
+// space already, the UART was locked by a thread, and the task retries after the
+// other ready tasks.
+//
+uint32_t uart_wait_tx_task(task_t* task)
+{
+	uint32_t irq = _save_and_disable_interrupts();
+
+	if ((rpi_uart->fr & UART_FR_TXFF) != 0)
+	{
+		task_queue_wait(&uart_tx_tasks, task, TIMEOUT_INFINITE);
+		rpi_uart->imsc |= UART0_TXIM;
+	}
+	else
+	{
+		task_yield(task);
+	}
+
+	_restore_interrupts(irq);
+	return TASK_WAITING;
+}
+
+
+
 //////////////////////////////////////////////////////////////////////////
 //
 // Locking wrapper functions
@@ -268,11 +494,40 @@ void uart_puts_nolock(const char *str)
 
 
 
+//
+// Wait until the TX FIFO may have space. Threads sleep until the TX interrupt 
+// fires, so lower priority threads run while a long write drains. The scheduler
+// thread cannot sleep and returns at once, to retry. Called with the UART locked,
+// so only one thread waits at a time.
+//
+static void uart_wait_tx(void)
+{
+	if (thread_get_id() == THREAD_SCHEDULER_THREAD_ID)
+		return;
+
+	uint32_t irq = _save_and_disable_interrupts();
+
+	if ((rpi_uart->fr & UART_FR_TXFF) != 0)
+	{
+		uart_tx_waiting = 1;
+		rpi_uart->imsc |= UART0_TXIM;
+		event_wait(uart_tx_event, TIMEOUT_INFINITE);
+	}
+
+	_restore_interrupts(irq);
+}
+
+
+
 //
 // Try to retrieve a character or return 0
 //
 uint8_t uart_trygetc(uint8_t* byte)
 {
+	// Once the RX interrupt drains the FIFO, received bytes are in the ring
+	if (uart_rx_sem != NULL)
+		return (uint8_t)spsc_pop(&uart_rx_ring, byte);
+
 	UART_TRY_LOCK();
 
 	uint8_t result = uart_trygetc_nolock(byte);
@@ -289,9 +544,18 @@ uint8_t uart_trygetc(uint8_t* byte)
 //
 uint8_t uart_getc(void)
 {
+	uint8_t ch;
+
+	// Sleep until the RX interrupt pushes a byte into the ring
+	if (uart_rx_sem != NULL)
+	{
+		while (!uart_read(&ch, 1, TIMEOUT_INFINITE))
+			;
+		return ch;
+	}
+
 	UART_LOCK();
 
-	uint8_t ch;
 	while (!uart_trygetc_nolock(&ch))
 		thread_yield();
 
@@ -326,7 +590,7 @@ void uart_putc(uint8_t byte)
 	UART_LOCK();
 
 	while (!uart_tryputc_nolock(byte))
-		thread_yield();
+		uart_wait_tx();
 
 	UART_UNLOCK();
 }
@@ -350,7 +614,7 @@ void uart_puts_len(const char *str, int len)
 	while (len--)
 	{
 		while (!uart_tryputc_nolock(*str))
-			thread_yield();
+			uart_wait_tx();
 		str++;
 	}
 
@@ -362,6 +626,26 @@ void uart_puts_len(const char *str, int len)
 
 
 
+//
+// Write binary data to the uart, without framing
+//
+void uart_write(const void* data, int len)
+{
+	UART_LOCK();
+
+	const uint8_t* ptr = (const uint8_t*)data;
+	while (len--)
+	{
+		while (!uart_tryputc_nolock(*ptr))
+			uart_wait_tx();
+		ptr++;
+	}
+
+	UART_UNLOCK();
+}
+
+
+
 //
 // Write a null-terminated string to the UART
 //
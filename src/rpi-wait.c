@@ -0,0 +1,145 @@
+/*
+	Licensed to the Apache Software Foundation (ASF) under one
+	or more contributor license agreements.  See the NOTICE file
+	distributed with this work for additional information
+	regarding copyright ownership.  The ASF licenses this file
+	to you under the Apache License, Version 2.0 (the
+	"License"); you may not use this file except in compliance
+	with the License.  You may obtain a copy of the License at
+
+	http://www.apache.org/licenses/LICENSE-2.0
+
+	Unless required by applicable law or agreed to in writing,
+	software distributed under the License is distributed on an
+	"AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+	KIND, either express or implied.  See the License for the
+	specific language governing permissions and limitations
+	under the License.
+*/
+#include "rpi-wait.h"
+#include "rpi-thread.h"
+#include "asm-functions.h"
+
+
+
+//
+// Acquire the objects if the wait is satisfied, returns the result of the wait or 
+// THREAD_WAIT_TIMEOUT when it is not satisfied. Called with interrupts disabled.
+//
+static uint32_t thread_wait_acquire(const thread_wait_object_t* objects, uint32_t count, uint32_t wait_all)
+{
+	if (!wait_all)
+	{
+		for (uint32_t i = 0; i < count; i++)
+		{
+			// Objects without acquire are only tested
+			const thread_wait_ops_t* ops = objects[i].ops;
+			if (ops->acquire != NULL ? ops->acquire(objects[i].object) : ops->is_ready(objects[i].object))
+				return i;
+		}
+		return THREAD_WAIT_TIMEOUT;
+	}
+
+	for (uint32_t i = 0; i < count; i++)
+	{
+		if (!objects[i].ops->is_ready(objects[i].object))
+			return THREAD_WAIT_TIMEOUT;
+	}
+	for (uint32_t i = 0; i < count; i++)
+	{
+		uint32_t acquired = objects[i].ops->acquire(objects[i].object);
+		ASSERT(acquired);
+		(void)acquired;
+	}
+	return 0;
+}
+
+
+
+//
+// Wait for multiple objects
+//
+uint32_t thread_wait_multiple(const thread_wait_object_t* objects, uint32_t count, uint32_t wait_all, sys_time_t timeout)
+{
+	ASSERT(count != 0 && count <= THREAD_WAIT_MAXIMUM);
+
+	// All objects are acquired at once, so none may be one that is only tested
+	for (uint32_t i = 0; wait_all && i < count; i++)
+		ASSERT(objects[i].ops->acquire != NULL);
+
+	sys_time_t deadline = TIMEOUT_INFINITE;
+	if (timeout != TIMEOUT_INFINITE)
+		deadline = sys_timer_get_time() + timeout;
+
+	// The thread sleeps on a queue of its own, which the wait blocks point to
+	thread_queue_t queue = { NULL, NULL };
+	thread_wait_block_t blocks[THREAD_WAIT_MAXIMUM];
+
+	// Test the objects and start waiting without being interrupted
+	uint32_t irq = _save_and_disable_interrupts();
+
+	uint32_t result;
+	while ((result = thread_wait_acquire(objects, count, wait_all)) == THREAD_WAIT_TIMEOUT)
+	{
+		sys_time_t remaining = TIMEOUT_INFINITE;
+		if (deadline != TIMEOUT_INFINITE)
+		{
+			sys_time_t time = sys_timer_get_time();
+			remaining = deadline > time ? deadline - time : 0;
+		}
+		if (remaining == 0)
+			break;
+
+		// Link a wait block to every object
+		for (uint32_t i = 0; i < count; i++)
+		{
+			thread_wait_list_t* list = objects[i].ops->wait_list(objects[i].object);
+			blocks[i].queue = &queue;
+			blocks[i].prev = NULL;
+			blocks[i].next = list->head;
+			if (list->head != NULL)
+				list->head->prev = &blocks[i];
+			list->head = &blocks[i];
+		}
+
+		// Sleep until an object notifies the thread or the timeout elapses
+		uint32_t notified = thread_queue_wait(&queue, THREAD_STATE_MULTI_WAIT, (void*)objects, remaining);
+
+		// Unlink the wait blocks
+		for (uint32_t i = 0; i < count; i++)
+		{
+			thread_wait_list_t* list = objects[i].ops->wait_list(objects[i].object);
+			if (blocks[i].prev != NULL)
+				blocks[i].prev->next = blocks[i].next;
+			else
+				list->head = blocks[i].next;
+			if (blocks[i].next != NULL)
+				blocks[i].next->prev = blocks[i].prev;
+		}
+
+		// On timeout, take what is ready now
+		if (!notified)
+		{
+			result = thread_wait_acquire(objects, count, wait_all);
+			break;
+		}
+	}
+
+	_restore_interrupts(irq);
+	return result;
+}
+
+
+
+//
+// Wake the threads on a wait list
+//
+void thread_wait_notify(thread_wait_list_t* list)
+{
+	uint32_t irq = _save_and_disable_interrupts();
+
+	for (thread_wait_block_t* block = list->head; block != NULL; block = block->next)
+		thread_queue_wake_one(block->queue, 1);
+
+	_restore_interrupts(irq);
+}
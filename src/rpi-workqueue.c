@@ -0,0 +1,220 @@
+/*
+	Licensed to the Apache Software Foundation (ASF) under one
+	or more contributor license agreements.  See the NOTICE file
+	distributed with this work for additional information
+	regarding copyright ownership.  The ASF licenses this file
+	to you under the Apache License, Version 2.0 (the
+	"License"); you may not use this file except in compliance
+	with the License.  You may obtain a copy of the License at
+
+	http://www.apache.org/licenses/LICENSE-2.0
+
+	Unless required by applicable law or agreed to in writing,
+	software distributed under the License is distributed on an
+	"AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+	KIND, either express or implied.  See the License for the
+	specific language governing permissions and limitations
+	under the License.
+*/
+#include "rpi-workqueue.h"
+#include "asm-functions.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <malloc.h>
+#include <stdio.h>
+
+
+
+//
+// Work queue structure
+//
+struct workqueue_t
+{
+	work_t*			items;			// Ring of queued work items
+	uint32_t		capacity;		// Size of the ring
+	uint32_t		head;			// Index of the oldest queued item
+	uint32_t		count;			// Number of queued items
+	uint32_t		pending;		// Number of queued and running items
+	uint32_t		idle_workers;	// Workers that wait for an item
+	uint32_t		space_waiters;	// Submitters that wait for free space
+	event_t*		not_empty;		// Signaled for idle workers when items are queued
+	event_t*		not_full;		// Signaled for waiting submitters when items are taken
+	event_t*		idle;			// Set while no items are pending
+};
+
+
+
+//
+// Worker thread
+//
+static void workqueue_thread(uint32_t thread_arg)
+{
+	workqueue_t* queue = (workqueue_t*)thread_arg;
+
+	while (1)
+	{
+		uint32_t irq = _save_and_disable_interrupts();
+
+		// Wait for an item. A signal can be left over from a submitter that saw
+		// this worker idle, so test the queue again after every wakeup.
+		while (queue->count == 0)
+		{
+			queue->idle_workers++;
+			_restore_interrupts(irq);
+			event_wait(queue->not_empty, TIMEOUT_INFINITE);
+			irq = _save_and_disable_interrupts();
+			queue->idle_workers--;
+		}
+
+		// Take the oldest item
+		work_t work = queue->items[queue->head];
+		if (++queue->head == queue->capacity)
+			queue->head = 0;
+		queue->count--;
+
+		// Let a waiting submitter use the free slot
+		if (queue->space_waiters != 0)
+			event_signal(queue->not_full);
+
+		_restore_interrupts(irq);
+
+		// Run the item and report its completion
+		work.fun(work.arg);
+		if (work.done != NULL)
+			event_signal(work.done);
+
+		irq = _save_and_disable_interrupts();
+		if (--queue->pending == 0)
+			event_signal(queue->idle);
+		_restore_interrupts(irq);
+	}
+}
+
+
+
+//
+// Create a work queue
+//
+workqueue_t* workqueue_create(uint32_t stack_size, char const* name, uint32_t priority, uint32_t thread_count, uint32_t capacity)
+{
+	ASSERT(thread_count != 0 && capacity != 0);
+
+	// Allocate and clear the queue data and the item ring
+	workqueue_t* queue = (workqueue_t*)malloc(sizeof(workqueue_t));
+	ASSERT(queue != NULL);
+	memset(queue, 0, sizeof(workqueue_t));
+	queue->items = (work_t*)malloc(capacity * sizeof(work_t));
+	ASSERT(queue->items != NULL);
+	queue->capacity = capacity;
+
+	// Create the events, the queue starts out idle
+	queue->not_empty = event_create(name, EVENT_TYPE_AUTO);
+	queue->not_full = event_create(name, EVENT_TYPE_AUTO);
+	queue->idle = event_create(name, EVENT_TYPE_MANUAL);
+	event_signal(queue->idle);
+
+	// Start the workers
+	for (uint32_t i = 0; i < thread_count; i++)
+	{
+		thread_id_t thread_id = thread_create(stack_size, name, &workqueue_thread, (uint32_t)queue);
+		thread_set_priority(thread_id, priority);
+	}
+
+	return queue;
+}
+
+
+
+//
+// Submit a work item
+//
+uint32_t workqueue_submit(workqueue_t* queue, work_fun_t fun, void* arg, event_t* done, sys_time_t timeout)
+{
+	work_t work = { fun, arg, done };
+	return workqueue_submit_batch(queue, &work, 1, timeout);
+}
+
+
+
+//
+// Submit a batch of work items
+//
+uint32_t workqueue_submit_batch(workqueue_t* queue, const work_t* items, uint32_t count, sys_time_t timeout)
+{
+	sys_time_t deadline = TIMEOUT_INFINITE;
+	if (timeout != TIMEOUT_INFINITE)
+		deadline = sys_timer_get_time() + timeout;
+
+	uint32_t submitted = 0;
+	uint32_t irq = _save_and_disable_interrupts();
+
+	while (submitted < count)
+	{
+		// Wait for free space until the deadline
+		if (queue->count == queue->capacity)
+		{
+			sys_time_t remaining = TIMEOUT_INFINITE;
+			if (deadline != TIMEOUT_INFINITE)
+			{
+				sys_time_t time = sys_timer_get_time();
+				remaining = deadline > time ? deadline - time : 0;
+			}
+
+			queue->space_waiters++;
+			_restore_interrupts(irq);
+			uint32_t result = event_wait(queue->not_full, remaining);
+			irq = _save_and_disable_interrupts();
+			queue->space_waiters--;
+
+			if (result == 0 && queue->count == queue->capacity)
+				break;
+			continue;
+		}
+
+		// The queue is no longer idle
+		if (queue->pending == 0)
+			event_reset(queue->idle);
+
+		// Copy the items that fit
+		uint32_t queued = 0;
+		while (submitted < count && queue->count < queue->capacity)
+		{
+			uint32_t index = queue->head + queue->count;
+			if (index >= queue->capacity)
+				index -= queue->capacity;
+			queue->items[index] = items[submitted++];
+			queue->count++;
+			queued++;
+		}
+		queue->pending += queued;
+
+		// Wake as many idle workers as there are new items
+		uint32_t wake = queued < queue->idle_workers ? queued : queue->idle_workers;
+		while (wake-- != 0)
+			event_signal(queue->not_empty);
+	}
+
+	_restore_interrupts(irq);
+	return submitted;
+}
+
+
+
+//
+// Wait until all submitted work items have completed
+//
+uint32_t workqueue_flush(workqueue_t* queue, sys_time_t timeout)
+{
+	return event_wait(queue->idle, timeout);
+}
+
+
+
+//
+// Get the number of work items that are queued or running
+//
+uint32_t workqueue_get_pending(workqueue_t* queue)
+{
+	return queue->pending;
+}
@@ -21,6 +21,8 @@
 #include "rpi-systimer.h"
 #include "rpi-interrupts.h"
 #include "rpi-thread.h"
+#include "rpi-smp.h"
+#include "asm-functions.h"
 
 #include <stdio.h>
 
@@ -70,6 +72,11 @@ extern void rpi_main(uint32_t);
 //
 void _cmain(unsigned int r0, unsigned int r1, unsigned int r2)
 {
+#if defined( RPI2 )
+	// Enable the MMU and caches, the kernel lock requires them
+	smp_init();
+#endif
+
 	// Execute __preinit and __init
 	call_init();
 
@@ -85,6 +92,9 @@ void _cmain(unsigned int r0, unsigned int r1, unsigned int r2)
 	// Enable the ARM system timer interrupt
 	sys_timer_enable();
 
+	// Start the cycle counter, threads are timed from their creation
+	_enable_cycle_counter();
+
 	// Create the thread that invokes main
 	thread_create(0x10000, "main_thread", &rpi_main, 0);
 
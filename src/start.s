@@ -30,6 +30,7 @@
 .equ    CPSR_MODE_SVR,          0x13
 .equ    CPSR_MODE_ABORT,        0x17
 .equ    CPSR_MODE_UNDEFINED,    0x1B
+.equ    CPSR_MODE_HYP,          0x1A
 .equ    CPSR_MODE_SYSTEM,       0x1F
 
 
@@ -59,6 +60,36 @@
 
 
 
+.ifdef RPI2
+//
+// Size of the supervisor stacks of the secondary cores
+//
+.equ	SECONDARY_STACK_SIZE,		0x4000
+
+
+
+//
+// The firmware may start the cores in hypervisor mode. Continue in supervisor
+// mode with interrupts disabled.
+//
+.arch_extension virt
+.macro LEAVE_HYP
+	mrs		r0, cpsr
+	and		r1, r0, #0x1F
+	cmp		r1, #CPSR_MODE_HYP
+	bne		1f
+	bic		r0, r0, #0x1F
+	orr		r0, r0, #(CPSR_MODE_SVR | CPSR_IRQ_INHIBIT | CPSR_FIQ_INHIBIT)
+	msr		spsr_cxsf, r0
+	add		r0, pc, #4					// Continue after the eret
+	msr		elr_hyp, r0
+	eret
+1:
+.endm
+.endif
+
+
+
 //
 // Entry point of rpi-os
 //
@@ -80,12 +111,12 @@ _start:
 	// Interrupt table, located directly after the jump table
 	//
 	_reset_h:                           .word   _reset_
-	_undefined_instruction_vector_h:    .word   undefined_instruction_vector
+	_undefined_instruction_vector_h:    .word   _undefined_entry
 	_software_interrupt_vector_h:       .word   software_interrupt_vector
 	_prefetch_abort_vector_h:           .word   prefetch_abort_vector
 	_data_abort_vector_h:               .word   data_abort_vector
 	_unused_handler_h:                  .word   _reset_
-	_interrupt_vector_h:                .word   interrupt_vector
+	_interrupt_vector_h:                .word   _interrupt_entry
 	_fast_interrupt_vector_h:           .word   fast_interrupt_vector
 
 
@@ -96,6 +127,10 @@ _start:
 // Note: ARM starts in supervisor mode (ARM Section A2.2)
 //
 _reset_:
+.ifdef RPI2
+	LEAVE_HYP
+.endif
+
 	//
 	// If the reset instruction is already at 0x0000, there's been a restart
 	//
@@ -187,3 +222,61 @@ _idle_loop:
 _restart:
 	bl		_led_blink
 	bl		_restart
+
+
+
+.ifdef RPI2
+//
+// Entry point of the secondary cores, which the firmware parks until their
+// local mailbox 3 holds an address. Started by smp_start_cores.
+//
+.global _secondary_start
+_secondary_start:
+	LEAVE_HYP
+
+
+
+    //
+	// Setup the supervisor stack of the core
+	//
+    mov		r0, #(CPSR_MODE_SVR | CPSR_IRQ_INHIBIT | CPSR_FIQ_INHIBIT )
+    msr		cpsr_c, r0
+	mrc		p15, 0, r0, c0, c0, 5
+	and		r0, r0, #3
+	ldr		r1, =_secondary_stacks
+	mov		r2, #SECONDARY_STACK_SIZE
+	mla		r1, r0, r2, r1
+	mov		sp, r1
+
+
+
+	//
+	// Setup the VFP coprocessor
+	//
+    mrc		p15, #0, r1, c1, c0, #2
+    orr		r1, r1, #(0xf << 20)
+    mcr		p15, #0, r1, c1, c0, #2
+    mov		r1, #0
+    mcr		p15, #0, r1, c7, c5, #4
+    mov		r1, #0x40000000
+    fmxr	fpexc, r1
+
+
+
+	//
+	// Run the scheduler of the core, should not return
+	//
+	bl		smp_secondary_main
+	b		_idle_loop
+
+
+
+//
+// Supervisor stacks of the secondary cores. The stack of core N ends at 
+// _secondary_stacks + N * SECONDARY_STACK_SIZE.
+//
+.section ".bss"
+.balign 8
+_secondary_stacks:
+	.space	SECONDARY_STACK_SIZE * 3
+.endif